@@ -2,4 +2,9 @@
 
 chmod u+x tests/nja tests/njc tests/refnjvm
 
-python tests/run_tests.py
+./njvm_unit_tests || exit 1
+
+python tests/run_tests.py || exit 1
+
+# The translated interpreter must produce the same output.
+python tests/run_tests.py --flags=--ir
@@ -0,0 +1,149 @@
+
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <cstring>
+
+#include "batch.h"
+
+namespace NJVM {
+
+    /**
+     * Read the whole contents of a binary file.
+     */
+    static std::vector<unsigned char> read_binary(const std::string &filename) {
+        std::ifstream input(filename, std::ios::binary);
+        if (!input) {
+            std::stringstream ss;
+            ss << "Unable to open file " << filename << ": " << std::strerror(errno);
+            throw std::invalid_argument(ss.str());
+        }
+        return {std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>()};
+    }
+
+    std::vector<batch_program> read_manifest(const char *filename) {
+        std::ifstream manifest(filename);
+        if (!manifest) {
+            throw std::invalid_argument(std::string("Unable to open manifest ").append(filename));
+        }
+        const std::filesystem::path directory = std::filesystem::path(filename).parent_path();
+
+        std::vector<batch_program> programs;
+        std::string line;
+        for (size_t line_number = 1; std::getline(manifest, line); line_number++) {
+            std::istringstream fields(line);
+            std::string keyword;
+            if (!(fields >> keyword) || keyword[0] == '#') {
+                continue; // Empty line or comment.
+            }
+
+            std::string path;
+            if (!(fields >> path)) {
+                std::stringstream ss;
+                ss << "Missing file name in line " << line_number << " of manifest " << filename << ".";
+                throw std::invalid_argument(ss.str());
+            }
+            path = (directory / path).string();
+
+            if (keyword == "program") {
+                programs.push_back({.binary_file = path, .binary = read_binary(path), .runs = {}});
+            } else if (keyword == "run" && !programs.empty()) {
+                std::string input;
+                std::getline(fields >> std::ws, input);
+                programs.back().runs.push_back({.output_file = path, .input = input});
+            } else {
+                std::stringstream ss;
+                ss << "Unexpected entry " << keyword << " in line " << line_number << " of manifest " << filename << ".";
+                throw std::invalid_argument(ss.str());
+            }
+        }
+        return programs;
+    }
+
+
+    /**
+     * Execute a single run on a machine that has the program loaded.
+     */
+    static void execute_run(machine &machine, const batch_run &run) {
+        std::string output = MESSAGE_START;
+        output += '\n';
+        size_t consumed = 0;
+        machine.redirect_io({
+                .read = [&run, &consumed](char *buffer, size_t size) {
+                    const size_t count = std::min(size, run.input.size() - consumed);
+                    std::memcpy(buffer, run.input.data() + consumed, count);
+                    consumed += count;
+                    return count;
+                },
+                .write = [&output](const char *data, size_t size) {
+                    output.append(data, size);
+                },
+        });
+
+        try {
+            machine.run();
+            machine.redirect_io({}); // Flushes remaining output.
+        } catch (...) {
+            machine.redirect_io({});
+            throw;
+        }
+        output += MESSAGE_STOP;
+        output += '\n';
+
+        std::ofstream file(run.output_file, std::ios::binary);
+        if (!file.write(output.data(), static_cast<std::streamsize>(output.size()))) {
+            throw std::runtime_error("Unable to write output file " + run.output_file);
+        }
+    }
+
+    size_t run_batch(const std::vector<batch_program> &programs, const machine_config &config,
+                     unsigned jobs, std::ostream &diagnostics) {
+        // Runs are handed out in manifest order, so consecutive runs of a worker usually share a program.
+        std::vector<std::pair<size_t, size_t>> runs;
+        for (size_t program = 0; program < programs.size(); program++) {
+            for (size_t run = 0; run < programs[program].runs.size(); run++) {
+                runs.emplace_back(program, run);
+            }
+        }
+
+        std::atomic<size_t> next_run = 0, failures = 0;
+        std::mutex diagnostics_mutex;
+        const auto worker = [&]() {
+            std::unique_ptr<machine> machine;
+            size_t loaded_program = programs.size();
+            for (size_t index; (index = next_run++) < runs.size();) {
+                const auto [program, run] = runs[index];
+                try {
+                    if (machine == nullptr) {
+                        machine = std::make_unique<NJVM::machine>(config); // Stack and heap are allocated once.
+                    }
+                    if (program != loaded_program) {
+                        loaded_program = programs.size(); // Machine is unusable, if loading fails.
+                        machine->load(programs[program].binary.data(), programs[program].binary.size());
+                        loaded_program = program;
+                    }
+                    machine->reset();
+                    execute_run(*machine, programs[program].runs[run]);
+                } catch (std::exception &exception) {
+                    failures++;
+                    std::scoped_lock lock(diagnostics_mutex);
+                    diagnostics << programs[program].runs[run].output_file << ": " << exception.what() << std::endl;
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned thread = 1; thread < jobs; thread++) {
+            threads.emplace_back(worker);
+        }
+        worker(); // The calling thread works as well.
+        for (std::thread &thread: threads) {
+            thread.join();
+        }
+        return failures;
+    }
+}
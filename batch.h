@@ -0,0 +1,67 @@
+
+#pragma once
+
+/**
+ * Batch runner of the NJVM, executing programs for many inputs within a
+ * single process.
+ *
+ * A manifest lists programs together with the inputs they are run for.
+ * Every program is read once and loaded into a machine, which is reset
+ * before each run, so stack and heap are allocated only once. Output of a
+ * run is written to a separate file, exactly as printed by the njvm
+ * executable. Runs can be distributed across multiple threads, each of
+ * them using its own machines.
+ */
+
+#include <string>
+#include <vector>
+#include <iostream>
+
+#include "libnjvm.h"
+
+namespace NJVM {
+
+    /**
+     * A single run of a program, reading the given input text.
+     */
+    struct batch_run {
+        std::string output_file;
+        std::string input;
+    };
+
+    /**
+     * A program listed in a manifest, together with its runs.
+     */
+    struct batch_program {
+        std::string binary_file;
+        std::vector<unsigned char> binary;
+        std::vector<batch_run> runs;
+    };
+
+    /**
+     * Read a manifest and the binaries of all programs listed in it.
+     *
+     * Every line of a manifest is either empty, a comment starting with #,
+     * or one of the following entries. Paths are relative to the directory
+     * of the manifest.
+     *
+     *   program BINARY
+     *        Following runs execute the given binary file.
+     *   run OUTPUT [INPUT...]
+     *        Run the program once, writing its output to OUTPUT. The rest
+     *        of the line is passed to the program as input, similar to the
+     *        input arrays of the test data files.
+     */
+    [[nodiscard]] std::vector<batch_program> read_manifest(const char *filename);
+
+    /**
+     * Execute all runs of the given programs using the given amount of
+     * threads. Runs failing with an error are reported to the diagnostics
+     * stream, while the remaining runs are executed nonetheless.
+     *
+     * @return the amount of failed runs.
+     */
+    size_t run_batch(const std::vector<batch_program> &programs, const machine_config &config,
+                     unsigned jobs, std::ostream &diagnostics);
+
+}
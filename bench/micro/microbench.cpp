@@ -0,0 +1,318 @@
+/**
+ * Microbenchmarks for the runtime primitives of the NJVM.
+ *
+ * Every benchmark is run for a set of arguments, usually describing the
+ * size of the processed objects. The amount of iterations is increased
+ * until a benchmark runs for a minimum amount of time, the time per
+ * iteration is reported afterwards. Only benchmarks containing the
+ * string given as first argument are run.
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstring>
+
+#include "njvm.h"
+#include "gc.h"
+#include "instructions.h"
+
+extern "C" {
+#include "lib/support.h"
+}
+
+namespace {
+    using namespace NJVM;
+
+    /**
+     * Minimum time a benchmark is run for a single argument.
+     */
+    constexpr std::chrono::nanoseconds MINIMUM_TIME = std::chrono::milliseconds(200);
+
+    /**
+     * Heap size used while benchmarking in kilobytes.
+     */
+    constexpr size_t BENCHMARK_HEAP_SIZE = 64 * 1024;
+
+    /**
+     * State passed to a benchmark, holding the argument and the amount
+     * of iterations the benchmark has to perform.
+     */
+    struct benchmark_state {
+        int64_t argument;
+        size_t iterations;
+    };
+
+    /**
+     * A named benchmark function together with the arguments it is run for.
+     */
+    struct benchmark {
+        const char *name;
+        void (*function)(benchmark_state &);
+        std::vector<int64_t> arguments;
+    };
+
+    /**
+     * Prevent the compiler from optimizing away the computation of a value.
+     */
+    template<typename T>
+    inline void do_not_optimize(T const &value) {
+        asm volatile("" : : "r,m"(value) : "memory");
+    }
+
+    /**
+     * Machine all benchmarks are run on.
+     */
+    VM machine;
+
+    /**
+     * Encode an instruction from mnemonic and immediate value.
+     */
+    instruction_t encode(const char *name, immediate_t immediate = 0) {
+        for (opcode_t opcode = 0; opcode < opcode_count(); opcode++) {
+            if (strcmp(info_for_opcode(opcode).name, name) == 0) {
+                return (static_cast<instruction_t>(opcode) << 24) | (immediate & 0x00FFFFFF);
+            }
+        }
+        throw std::invalid_argument(std::string("Unknown instruction ").append(name));
+    }
+
+    /**
+     * Create a big integer with the given amount of digits, all of them set.
+     */
+    ObjRef make_big(int64_t digits) {
+        auto object = static_cast<ObjRef>(newPrimObject(static_cast<int>(sizeof(int) + 1 + digits)));
+        Big *big = static_cast<Big *>(getPrimObjectDataPointer(object));
+        big->nd = static_cast<int>(digits);
+        big->sign = 1; // Positive.
+        for (int64_t digit = 0; digit < digits; digit++) {
+            big->digits[digit] = static_cast<unsigned char>(0x5A + digit);
+        }
+        return object;
+    }
+
+    /**
+     * Reset the machine between benchmarks, so no objects are kept alive.
+     */
+    void reset_machine() {
+        machine.sp = machine.fp = machine.pc = 0;
+        machine.ret = nil;
+        bip.op1 = bip.op2 = bip.res = bip.rem = nullptr;
+        for (auto &entry: machine.static_data) {
+            entry = nil;
+        }
+        gc(machine);
+    }
+
+
+    //-----------------------------------------------------------------------
+    // Heap and garbage collection.
+    //-----------------------------------------------------------------------
+
+    void bench_halloc(benchmark_state &state) {
+        for (size_t i = 0; i < state.iterations; i++) {
+            do_not_optimize(halloc(machine, state.argument));
+        }
+    }
+
+    void bench_gc_rescue(benchmark_state &state) {
+        // Build a list of the given length, rooted in static data.
+        machine.static_data[0] = nil;
+        for (int64_t i = 0; i < state.argument; i++) {
+            ObjRef element = newNinjaObject(machine, 2);
+            get_member(element, 1) = machine.static_data[0];
+            machine.static_data[0] = element;
+        }
+        for (size_t i = 0; i < state.iterations; i++) {
+            gc(machine);
+        }
+    }
+
+
+    //-----------------------------------------------------------------------
+    // Object access and creation.
+    //-----------------------------------------------------------------------
+
+    void bench_new_integer(benchmark_state &state) {
+        for (size_t i = 0; i < state.iterations; i++) {
+            do_not_optimize(newNinjaInteger(state.argument));
+        }
+    }
+
+    void bench_new_object(benchmark_state &state) {
+        for (size_t i = 0; i < state.iterations; i++) {
+            do_not_optimize(newNinjaObject(machine, state.argument));
+        }
+    }
+
+    void bench_try_access_member(benchmark_state &state) {
+        machine.static_data[0] = newNinjaObject(machine, state.argument);
+        for (size_t i = 0; i < state.iterations; i++) {
+            do_not_optimize(try_access_member(machine.static_data[0], static_cast<int64_t>(i % state.argument)));
+        }
+    }
+
+
+    //-----------------------------------------------------------------------
+    // Big integer arithmetic.
+    //-----------------------------------------------------------------------
+
+    template<void Operation()>
+    void bench_big(benchmark_state &state) {
+        machine.static_data[0] = make_big(state.argument);
+        machine.static_data[1] = make_big(std::max<int64_t>(1, state.argument / 2));
+        for (size_t i = 0; i < state.iterations; i++) {
+            bip.op1 = machine.static_data[0];
+            bip.op2 = machine.static_data[1];
+            Operation();
+            do_not_optimize(bip.res);
+        }
+    }
+
+
+    //-----------------------------------------------------------------------
+    // Execution of single instructions. The stack is prepared before and
+    // reset after executing an instruction, which is included in timings.
+    //-----------------------------------------------------------------------
+
+    void bench_exec_pushc(benchmark_state &state) {
+        const instruction_t instruction = encode("pushc", static_cast<immediate_t>(state.argument));
+        for (size_t i = 0; i < state.iterations; i++) {
+            exec_instruction(machine, instruction);
+            machine.sp = 0;
+        }
+    }
+
+    void bench_exec_pushl(benchmark_state &state) {
+        const instruction_t instruction = encode("pushl", 0);
+        machine.stack[0] = newNinjaInteger(state.argument);
+        machine.fp = 0;
+        for (size_t i = 0; i < state.iterations; i++) {
+            machine.sp = 1;
+            exec_instruction(machine, instruction);
+        }
+    }
+
+    template<const char *Mnemonic>
+    void bench_exec_binary(benchmark_state &state) {
+        const instruction_t instruction = encode(Mnemonic);
+        machine.static_data[0] = newNinjaInteger(state.argument);
+        machine.static_data[1] = newNinjaInteger(state.argument / 2 + 1);
+        for (size_t i = 0; i < state.iterations; i++) {
+            machine.stack[0] = machine.static_data[0];
+            machine.stack[1] = machine.static_data[1];
+            machine.sp = 2;
+            exec_instruction(machine, instruction);
+        }
+    }
+
+    void bench_exec_getf(benchmark_state &state) {
+        const instruction_t instruction = encode("getf", static_cast<immediate_t>(state.argument - 1));
+        machine.static_data[0] = newNinjaObject(machine, state.argument);
+        for (size_t i = 0; i < state.iterations; i++) {
+            machine.stack[0] = machine.static_data[0];
+            machine.sp = 1;
+            exec_instruction(machine, instruction);
+        }
+    }
+
+    void bench_exec_new(benchmark_state &state) {
+        const instruction_t instruction = encode("new", static_cast<immediate_t>(state.argument));
+        for (size_t i = 0; i < state.iterations; i++) {
+            exec_instruction(machine, instruction);
+            machine.sp = 0;
+        }
+    }
+
+    void bench_exec_jmp(benchmark_state &state) {
+        const instruction_t instruction = encode("jmp", 0);
+        for (size_t i = 0; i < state.iterations; i++) {
+            exec_instruction(machine, instruction);
+        }
+    }
+
+    constexpr char ADD[] = "add", MUL[] = "mul", DIV[] = "div", LT[] = "lt";
+
+    const std::vector<benchmark> BENCHMARKS = {
+            {"halloc",                 bench_halloc,                {16, 64, 256, 4096}},
+            {"gc_rescue",              bench_gc_rescue,             {10, 1000, 100000}},
+            {"newNinjaInteger",        bench_new_integer,           {1, 1 << 20, -(1 << 30)}},
+            {"newNinjaObject",         bench_new_object,            {0, 2, 64, 1024}},
+            {"try_access_member",      bench_try_access_member,     {1, 64, 4096}},
+            {"bigAdd",                 bench_big<bigAdd>,           {1, 8, 64, 512}},
+            {"bigMul",                 bench_big<bigMul>,           {1, 8, 64, 512}},
+            {"bigDiv",                 bench_big<bigDiv>,           {1, 8, 64, 512}},
+            {"exec_instruction/pushc", bench_exec_pushc,            {1, 1 << 20}},
+            {"exec_instruction/pushl", bench_exec_pushl,            {1}},
+            {"exec_instruction/add",   bench_exec_binary<ADD>,      {1, 1 << 20}},
+            {"exec_instruction/mul",   bench_exec_binary<MUL>,      {1, 1 << 20}},
+            {"exec_instruction/div",   bench_exec_binary<DIV>,      {1, 1 << 20}},
+            {"exec_instruction/lt",    bench_exec_binary<LT>,       {1, 1 << 20}},
+            {"exec_instruction/getf",  bench_exec_getf,             {1, 64}},
+            {"exec_instruction/new",   bench_exec_new,              {0, 2, 64}},
+            {"exec_instruction/jmp",   bench_exec_jmp,              {0}},
+    };
+
+    /**
+     * Run a benchmark for the given argument, increasing the amount of
+     * iterations until the minimum time is reached. Returns the time
+     * per iteration in nanoseconds.
+     */
+    double run_benchmark(const benchmark &bench, int64_t argument, size_t &iterations) {
+        for (iterations = 1;; iterations *= 2) {
+            reset_machine();
+            benchmark_state state{.argument = argument, .iterations = iterations};
+            const auto start = std::chrono::steady_clock::now();
+            bench.function(state);
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+
+            if (elapsed >= MINIMUM_TIME) {
+                return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) /
+                       static_cast<double>(iterations);
+            }
+        }
+    }
+}
+
+
+int main(int argc, char *argv[]) {
+    try {
+        const char *filter = argc > 1 ? argv[1] : "";
+
+        // The machine only needs a few slots to execute single instructions.
+        NJVM::vm_scope scope(machine);
+        machine.program = std::vector<NJVM::instruction_t>(1);
+        machine.static_data = std::vector<NJVM::ObjRef>(2);
+        machine.stack = NJVM::ninja_stack(16, 16);
+        NJVM::initialize_heap(machine, {
+                .heap_size_kbytes = BENCHMARK_HEAP_SIZE,
+                .gcstats = false,
+                .gcpurge = false,
+                .allocprofile = false,
+                .gclog = nullptr,
+        });
+
+        std::cout << std::left << std::setw(36) << "benchmark" << std::right
+                  << std::setw(14) << "iterations" << std::setw(14) << "ns/op" << std::endl;
+        for (const benchmark &bench: BENCHMARKS) {
+            if (strstr(bench.name, filter) == nullptr) {
+                continue;
+            }
+            for (int64_t argument: bench.arguments) {
+                size_t iterations;
+                const double time = run_benchmark(bench, argument, iterations);
+                std::cout << std::left << std::setw(36) << (std::string(bench.name) + "/" + std::to_string(argument))
+                          << std::right << std::setw(14) << iterations
+                          << std::setw(14) << std::fixed << std::setprecision(2) << time << std::endl;
+            }
+        }
+
+        NJVM::free_heap(machine);
+        return 0;
+    } catch (std::exception &exception) {
+        std::cerr << exception.what();
+        return 1;
+    }
+}
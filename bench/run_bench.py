@@ -0,0 +1,155 @@
+#! /usr/bin/env python3
+
+from os import path, makedirs
+import sys
+import json
+import time
+import re
+import argparse
+import statistics
+import subprocess
+import tempfile
+
+directory = path.dirname(path.abspath(__file__))
+tools = path.join(path.dirname(directory), 'tests')
+
+parser = argparse.ArgumentParser(description='Run the NJVM benchmark suite.')
+parser.add_argument('benchmarks', nargs='*', help='names of benchmarks to run (default: all)')
+parser.add_argument('--njvm', default='./njvm', help='path to the njvm executable')
+parser.add_argument('--runs', type=int, default=5, help='timed runs per benchmark')
+parser.add_argument('--workdir', default=None, help='directory receiving assembled binaries and logs')
+parser.add_argument('--baseline', default=None, help='compare against results saved in this JSON file')
+parser.add_argument('--save', default=None, help='save results as JSON to this file')
+parser.add_argument('--threshold', type=float, default=10.0,
+                    help='slowdown in percent compared to the baseline flagged as regression')
+parser.add_argument('--ir', action='store_true', help='time the interpreter of translated programs')
+parser.add_argument('--flags', default='', help='additional flags passed to njvm in timed runs, e.g. --flags=--gccompact')
+arguments = parser.parse_args()
+
+with open(path.join(directory, 'suite.json')) as suite_file:
+    suite = json.load(suite_file)
+if arguments.benchmarks:
+    suite = {name: suite[name] for name in arguments.benchmarks}
+
+workdir = arguments.workdir or tempfile.mkdtemp(prefix='njvm_bench_')
+makedirs(workdir, exist_ok=True)
+print('Running ' + str(len(suite)) + ' benchmarks with ' + str(arguments.runs) + ' runs each.')
+
+def exec(cmd):
+    if subprocess.call(cmd) != 0:
+        raise ValueError("Failed to start subprocess: " + str(cmd))
+
+def prepare_binary(name, data):
+    source = path.join(directory, data['file'])
+    extension = path.splitext(source)[1]
+    asm_file = path.join(workdir, name + '.asm')
+    bin_file = path.join(workdir, name + '.bin')
+
+    if extension.startswith('.nj'):
+        exec([path.join(tools, 'njc'), '--output', asm_file, source])
+    else:
+        asm_file = source
+    exec([path.join(tools, 'nja'), asm_file, bin_file])
+    return bin_file
+
+def run_njvm(bin_file, input_text, flags):
+    process = subprocess.run([arguments.njvm, bin_file] + flags, input=input_text.encode('utf-8'),
+                             stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+    if process.returncode != 0:
+        raise ValueError('njvm failed: ' + process.stderr.decode('utf-8', 'replace'))
+    return process.stderr.decode('utf-8', 'replace')
+
+def read_gclog(log_file):
+    allocated_objects = 0
+    allocated_bytes = 0
+    summary = {}
+    with open(log_file) as log:
+        for line in log:
+            entry = json.loads(line)
+            if 'summary' in entry:
+                summary = entry['summary']
+            elif entry.get('phase') != 'initial': # Concurrent marking starts without allocation counts.
+                allocated_objects += entry['allocated_objects']
+                allocated_bytes += entry['allocated_bytes']
+    return allocated_objects, allocated_bytes, summary
+
+def run_benchmark(name, data):
+    bin_file = prepare_binary(name, data)
+    input_text = ' '.join(str(value) for value in data['input'])
+    log_file = path.join(workdir, name + '.gclog')
+
+    # Instructions are counted once by the profiler, as profiling distorts timing.
+    profile = run_njvm(bin_file, input_text, ['--profile'])
+    instructions = int(re.search(r'Profile: (\d+) instructions executed', profile).group(1))
+    statistics_output = run_njvm(bin_file, input_text, ['--ir', '--perfstats'])
+    dispatches = int(re.search(r'executed in (\d+) dispatches', statistics_output).group(1))
+
+    times = []
+    pauses = []
+    for _ in range(arguments.runs):
+        start = time.perf_counter()
+        run_njvm(bin_file, input_text,
+                 ['--gclog', log_file] + (['--ir'] if arguments.ir else []) + arguments.flags.split())
+        times.append(time.perf_counter() - start)
+        allocated_objects, allocated_bytes, summary = read_gclog(log_file)
+        pauses.append(summary)
+
+    median = statistics.median(times)
+    return {
+        'median_s': median,
+        'instructions': instructions,
+        'ir_dispatches': dispatches,
+        'instructions_per_second': instructions / median,
+        'allocated_objects': allocated_objects,
+        'allocated_bytes': allocated_bytes,
+        'collections': pauses[0].get('collections', 0),
+        'gc_pause_ns': statistics.median(summary.get('total_ns', 0) for summary in pauses),
+        'gc_max_pause_ns': max(summary.get('max_ns', 0) for summary in pauses),
+        'peak_rss_kb': max(summary.get('peak_rss_kb', 0) for summary in pauses),
+    }
+
+
+
+results = {}
+for name, data in suite.items():
+    try:
+        results[name] = run_benchmark(name, data)
+    except Exception as e:
+        print('Error in benchmark ' + name + ': ' + str(e))
+
+print('{:<12}{:>12}{:>14}{:>10}{:>14}{:>8}{:>12}{:>12}{:>10}'.format(
+    'benchmark', 'median ms', 'Minstr/s', 'IR disp%', 'allocations', 'gcs', 'pause ms', 'max us', 'RSS MB'))
+for name, result in results.items():
+    print('{:<12}{:>12.2f}{:>14.2f}{:>10.1f}{:>14}{:>8}{:>12.3f}{:>12.1f}{:>10.1f}'.format(
+        name, result['median_s'] * 1e3, result['instructions_per_second'] / 1e6,
+        100.0 * result['ir_dispatches'] / result['instructions'], result['allocated_objects'],
+        result['collections'], result['gc_pause_ns'] / 1e6, result['gc_max_pause_ns'] / 1e3,
+        result['peak_rss_kb'] / 1024))
+
+if arguments.save:
+    with open(arguments.save, 'w') as save_file:
+        json.dump(results, save_file, indent=4, sort_keys=True)
+    print('Saved results to ' + arguments.save)
+
+regressions = 0
+if arguments.baseline:
+    with open(arguments.baseline) as baseline_file:
+        baseline = json.load(baseline_file)
+    print('Comparing against baseline ' + arguments.baseline)
+    for name, result in results.items():
+        if name not in baseline:
+            continue
+        change = 100.0 * (result['median_s'] / baseline[name]['median_s'] - 1.0)
+        flag = ''
+        if change > arguments.threshold:
+            flag = '  REGRESSION'
+            regressions += 1
+        # Baselines saved before the peak resident set size was logged lack it.
+        rss_change = ''
+        if baseline[name].get('peak_rss_kb') and result['peak_rss_kb']:
+            rss_change = '{:>+10.1f}% RSS'.format(100.0 * (result['peak_rss_kb'] / baseline[name]['peak_rss_kb'] - 1.0))
+        print('{:<12}{:>+10.1f}%{}{}'.format(name, change, rss_change, flag))
+
+if len(results) < len(suite) or regressions > 0:
+    sys.exit(1)
+sys.exit(0)
@@ -1,74 +1,175 @@
 
 #include <iostream>
+#include <iomanip>
 #include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <chrono>
+#include <numeric>
+#include <bit>
+#include <string>
 
 #include "gc.h"
 #include "njvm.h"
+#include "instructions.h"
+#include "perf.h"
 
 
 namespace NJVM {
-    // Global heap management configuration.
-    bool gcstats, gcpurge;
-    unsigned char *heap = nullptr;
+    /**
+     * Amount of root references holding an object, per category of roots.
+     */
+    struct root_counts {
+        size_t stack = 0, static_data = 0, bip = 0, ret = 0;
+    };
 
-    // Heap is split into two halfs.
     /**
-     * Pointer to active heap half.
+     * Words of the heap covered by a single entry of the live word bitmap.
      */
-    unsigned char *active_half,
+    constexpr size_t BLOCK_WORDS = 64;
+    constexpr size_t BLOCK_BYTES = BLOCK_WORDS * OBJECT_ALIGNMENT;
+
+
     /**
-     * Pointer to secondary heap half.
-     * Used to copy live objects during garbage collection.
+     * Attribute an allocation to the instruction currently executing.
      */
-    *unused_half;
+    static void record_allocation(VM &vm, ObjRef object, size_t size) {
+        managed_heap &heap = vm.heap;
+        if (heap.allocation_sites.size() != vm.program.size()) {
+            heap.allocation_sites.resize(vm.program.size());
+        }
+        const int32_t site = vm.pc - 1; // The pc was already incremented when executing.
+        if (site < 0 || static_cast<size_t>(site) >= heap.allocation_sites.size()) {
+            return;
+        }
+        heap.allocation_sites[site].objects++;
+        heap.allocation_sites[site].bytes += size;
+        heap.allocation_origins.push_back({
+                .offset = static_cast<size_t>(reinterpret_cast<unsigned char *>(object) - heap.active_half),
+                .site = site});
+    }
 
     /**
-     * Amount of bytes available per heap half.
-     *
-     * This value is not touched after initialization.
+     * Count an object allocated since the last collection as survivor,
+     * given its location in the heap half that is being evacuated.
      */
-    size_t bytes_available,
+    static void record_survivor(managed_heap &heap, size_t offset, size_t size) {
+        auto origin = std::ranges::lower_bound(heap.allocation_origins, offset, {}, &allocation_origin::offset);
+        if (origin != heap.allocation_origins.end() && origin->offset == offset) {
+            heap.allocation_sites[origin->site].survived_objects++;
+            heap.allocation_sites[origin->site].survived_bytes += size;
+        }
+    }
+
     /**
-     * Amount of bytes used in the currently active heap half.
+     * Waits for the marker thread and discards the marking, if marking.
      */
-    bytes_used = 0;
+    static void stop_marking(managed_heap &heap) {
+        if (heap.marking) {
+            heap.marking_cancelled = true;
+            heap.marker.join();
+            heap.marking_cancelled = false;
+            heap.marking = false;
+            heap.satb_log.clear();
+            heap.mark_stack.clear();
+            std::ranges::fill(heap.live_words, 0);
+        }
+    }
+
+    /**
+     * Amount of checks whether concurrent marking finished per heap size allocated.
+     */
+    constexpr size_t MARKING_CHECKS = 32;
 
     /**
-     * Amount of allocations in the currently active heap half.
+     * Sets the offset beyond which allocations take the slow path. With
+     * concurrent marking, it starts marking once three quarters of the heap
+     * are used, leaving the last quarter for allocations while marking, and
+     * checks whether marking finished every time another share of the heap
+     * is allocated.
      */
-    size_t allocations = 0;
+    static void update_allocation_limit(managed_heap &heap) {
+        size_t limit = heap.bytes_available;
+        if (heap.config.algorithm == gc_algorithm::concurrent_mark) {
+            limit = heap.marking ? heap.bytes_used + heap.bytes_available / MARKING_CHECKS
+                                 : heap.bytes_available - heap.bytes_available / 4;
+        }
+        heap.allocation_limit = std::clamp(limit, heap.bytes_used, heap.bytes_available);
+    }
 
-    void initialize_heap(gc_config config) {
-        if (heap != nullptr) {
+    void initialize_heap(VM &vm, gc_config config) {
+        managed_heap &heap = vm.heap;
+        if (heap.memory != nullptr) {
             throw std::logic_error("Heap already initialized!");
         }
 
-        gcstats = config.gcstats;
-        gcpurge = config.gcpurge;
+        heap.config = config;
+        heap.initialized = std::chrono::steady_clock::now();
+        if (config.gclog != nullptr) {
+            heap.log.open(config.gclog);
+            if (!heap.log) {
+                throw std::invalid_argument(std::string("Unable to create gc log file ").append(config.gclog));
+            }
+        }
 
         const size_t total_heap_size = config.heap_size_kbytes * 1024;
-        if (total_heap_size > 2 * MAXIMUM_HEAP_HALF_SIZE) {
+        const bool compact = config.algorithm != gc_algorithm::copying;
+        const size_t maximum_heap_size = compact ? MAXIMUM_HEAP_HALF_SIZE : 2 * MAXIMUM_HEAP_HALF_SIZE;
+        if (total_heap_size > maximum_heap_size) {
             std::stringstream ss;
             ss << "Requested heap size of " << total_heap_size << " bytes"
-               << " exceeds limit of " << (2 * MAXIMUM_HEAP_HALF_SIZE) << " bytes.";
+               << " exceeds limit of " << maximum_heap_size << " bytes.";
             throw std::logic_error(ss.str());
         }
 
-        bytes_available = total_heap_size / 2;
-        heap = static_cast<unsigned char *>(malloc(total_heap_size));
-        if (heap == nullptr) {
+        heap.bytes_available = compact ? total_heap_size : total_heap_size / 2;
+        heap.memory = static_cast<unsigned char *>(malloc(total_heap_size));
+        if (heap.memory == nullptr) {
             throw std::bad_alloc();
         }
 
-        active_half = heap;
-        unused_half = heap + bytes_available;
-        if (gcpurge) {
-            std::memset(heap, 0, total_heap_size);
+        heap.active_half = heap.memory;
+        heap.unused_half = compact ? nullptr : heap.memory + heap.bytes_available;
+        if (compact) {
+            const size_t blocks = (heap.bytes_available + BLOCK_BYTES - 1) / BLOCK_BYTES;
+            heap.live_words.assign(blocks, 0);
+            heap.block_offsets.assign(blocks, 0);
+        }
+        heap.bytes_used = 0;
+        heap.allocations = 0;
+        update_allocation_limit(heap);
+        if (config.gcpurge) {
+            std::memset(heap.memory, 0, total_heap_size);
+        }
+    }
+
+    void free_heap(VM &vm) {
+        managed_heap &heap = vm.heap;
+        stop_marking(heap);
+        free(heap.memory);
+        heap.memory = nullptr;
+        if (heap.log.is_open()) {
+            heap.log.close();
+        }
+    }
+
+    void reset_heap(VM &vm) {
+        managed_heap &heap = vm.heap;
+        stop_marking(heap);
+        heap.bytes_used = 0;
+        heap.allocations = 0;
+        update_allocation_limit(heap);
+        heap.allocation_origins.clear();
+        heap.scratch_used = 0;
+        heap.allocate_scratch = false;
+        if (heap.config.gcpurge) {
+            std::memset(heap.active_half, 0, heap.bytes_available);
         }
     }
 
-    void free_heap() {
-        free(heap);
+    managed_heap::~managed_heap() {
+        stop_marking(*this);
+        free(memory);
     }
 
 
@@ -78,10 +179,10 @@ namespace NJVM {
      * This function does not perform any checks. It is only used to
      * keep management information consistent.
      */
-    [[nodiscard]] static inline ObjRef allocate(size_t size) {
-        unsigned char *allocated = active_half + bytes_used;
-        bytes_used += size;
-        allocations++;
+    [[nodiscard]] static inline ObjRef allocate(managed_heap &heap, size_t size) {
+        unsigned char *allocated = heap.active_half + heap.bytes_used;
+        heap.bytes_used += size;
+        heap.allocations++;
         return reinterpret_cast<ObjRef>(allocated);
     }
 
@@ -89,7 +190,7 @@ namespace NJVM {
      * Rescues the object referenced by the given parameter. The storage location is passed as a pointer
      * so the reference can be updated to point to the copy allocated on the other heap half.
      */
-    static void rescue(ObjRef *original) { /* ObjRef& would be nicer but doesn't work well with bip registers. */
+    static void rescue(managed_heap &heap, ObjRef *original) { /* ObjRef& would be nicer but doesn't work well with bip registers. */
         ObjRef &originalReference = *original;
 
         if (originalReference == nil) {
@@ -97,20 +198,24 @@ namespace NJVM {
 
         } else if (originalReference->is_copied()) {
             // Referenced object was already copied. Update reference.
-            originalReference = reinterpret_cast<ObjRef>(active_half + (*original)->get_size());
+            originalReference = reinterpret_cast<ObjRef>(heap.active_half + (*original)->get_size());
 
         } else {
             // Allocate a copy.
-            ObjRef copied = allocate(object_size(originalReference->get_size(), originalReference->is_compound()));
-            copied->tag = originalReference->tag; // Copy size including flags.
+            const size_t size = allocation_size(originalReference->get_size(), originalReference->is_compound());
+            ObjRef copied = allocate(heap, size);
+            std::memcpy(copied, originalReference, sizeof(ninja_object)); // Copy size including flags.
+            if (heap.config.allocprofile) {
+                record_survivor(heap, reinterpret_cast<unsigned char *>(originalReference) - heap.unused_half, size);
+            }
 
             // Mark original as copied and place forward reference.
-            originalReference->mark_copied(reinterpret_cast<unsigned char *>(copied) - active_half);
+            originalReference->mark_copied(reinterpret_cast<unsigned char *>(copied) - heap.active_half);
 
             // Rescue all members, if this element stores references.
             if (copied->is_compound()) {
                 for (size_t i = 0; i < copied->get_size(); i++) {
-                    rescue(&get_member(originalReference, i));
+                    rescue(heap, &get_member(originalReference, i));
                 }
 
             }
@@ -120,68 +225,609 @@ namespace NJVM {
         }
     }
 
-    void gc() {
-        if (gcstats) {
-            std::cerr << "Allocated since last gc: " << allocations << " objects (" << bytes_used << " bytes)."
-                      << std::endl;
+    /**
+     * Calls visit with the location of every root reference of a machine,
+     * that is not nil. Roots are counted per category.
+     */
+    template<typename Visitor>
+    static void for_each_root(VM &vm, root_counts &roots, Visitor &&visit) {
+        const auto root = [&visit](ObjRef *reference, size_t &counter) {
+            if (*reference != nil) {
+                counter++;
+                visit(reference);
+            }
+        };
+        // Objects stored in bip registers.
+        root(reinterpret_cast<ObjRef *>(&bip.op1), roots.bip);
+        root(reinterpret_cast<ObjRef *>(&bip.op2), roots.bip);
+        root(reinterpret_cast<ObjRef *>(&bip.res), roots.bip);
+        root(reinterpret_cast<ObjRef *>(&bip.rem), roots.bip);
+        // Objects stored in return register.
+        root(&vm.ret, roots.ret);
+        // Objects stored in static data.
+        for (auto &entry: vm.static_data) {
+            root(&entry, roots.static_data);
         }
+        // Objects stored on stack.
+        for (int32_t offset = 0; offset < vm.sp; offset++) {
+            if (vm.stack[offset].isObjRef) {
+                root(&vm.stack[offset].as_reference(), roots.stack);
+            }
+        }
+        // Objects stored by waiting threads.
+        for (ninja_thread &thread: vm.waiting_threads) {
+            root(&thread.ret, roots.ret);
+            for (int32_t offset = 0; offset < thread.sp; offset++) {
+                if (thread.stack[offset].isObjRef) {
+                    root(&thread.stack[offset].as_reference(), roots.stack);
+                }
+            }
+        }
+    }
+
+    /**
+     * Copies all live objects into the unused heap half, which becomes the
+     * active half afterwards.
+     */
+    static void copy_live_objects(VM &vm, root_counts &roots) {
+        managed_heap &heap = vm.heap;
         // Reset management information.
-        bytes_used = 0;
-        allocations = 0;
+        heap.bytes_used = 0;
+        heap.allocations = 0;
 
         // Mark the other half active as it is now used to allocate objects during copying.
-        std::swap(active_half, unused_half);
+        std::swap(heap.active_half, heap.unused_half);
+        for_each_root(vm, roots, [&heap](ObjRef *root) {
+            rescue(heap, root);
+        });
+
+        if (heap.config.gcpurge) {
+            std::memset(heap.unused_half, 0, heap.bytes_available);
+        }
+    }
+
+
+    /**
+     * Returns true, if the object is stored in the used part of the heap.
+     * Temporaries in the scratch arena are not.
+     */
+    static bool in_heap(const managed_heap &heap, ObjRef object) {
+        const auto address = reinterpret_cast<uintptr_t>(object);
+        return address - reinterpret_cast<uintptr_t>(heap.active_half) < heap.bytes_used;
+    }
+
+    /**
+     * Index of the first word of an object in the live word bitmap.
+     */
+    static size_t word_index(const managed_heap &heap, ObjRef object) {
+        return (reinterpret_cast<unsigned char *>(object) - heap.active_half) / OBJECT_ALIGNMENT;
+    }
+
+    static bool is_marked(const managed_heap &heap, ObjRef object) {
+        const size_t word = word_index(heap, object);
+        return (heap.live_words[word / BLOCK_WORDS] >> (word % BLOCK_WORDS) & 1) != 0;
+    }
+
+    /**
+     * Marks count words starting at the given word as live.
+     */
+    static void mark_words(managed_heap &heap, size_t word, size_t count) {
+        while (count > 0) {
+            const size_t bit = word % BLOCK_WORDS;
+            const size_t marked = std::min(count, BLOCK_WORDS - bit);
+            const uint64_t mask = marked == BLOCK_WORDS ? ~uint64_t{0} : ((uint64_t{1} << marked) - 1) << bit;
+            heap.live_words[word / BLOCK_WORDS] |= mask;
+            word += marked;
+            count -= marked;
+        }
+    }
+
+    /**
+     * Returns the first live word at or after the given word, or end if
+     * there is none. Blocks without live words are skipped at once.
+     */
+    static size_t next_live_word(const managed_heap &heap, size_t word, size_t end) {
+        while (word < end) {
+            const uint64_t live = heap.live_words[word / BLOCK_WORDS] >> (word % BLOCK_WORDS);
+            if (live != 0) {
+                return std::min(end, word + std::countr_zero(live));
+            }
+            word = (word / BLOCK_WORDS + 1) * BLOCK_WORDS;
+        }
+        return end;
+    }
+
+    /**
+     * Returns the location a live object is moved to by compaction, which is
+     * the offset of its block plus the size of all live words preceding it
+     * within the block.
+     */
+    static ObjRef forward(const managed_heap &heap, ObjRef object) {
+        const size_t word = word_index(heap, object);
+        const uint64_t preceding = heap.live_words[word / BLOCK_WORDS] & ((uint64_t{1} << (word % BLOCK_WORDS)) - 1);
+        return reinterpret_cast<ObjRef>(heap.active_half + heap.block_offsets[word / BLOCK_WORDS]
+                                        + std::popcount(preceding) * OBJECT_ALIGNMENT);
+    }
+
+    /**
+     * Marks an object stored below the given offset as live, unless it is
+     * marked already. Compound objects are pushed onto the mark stack, so
+     * their members are marked by trace.
+     *
+     * The header is loaded atomically, as the marker thread may run while
+     * the program updates the flags of an integer. Sizes never change.
+     */
+    static void mark_object(managed_heap &heap, ObjRef object, size_t top) {
+        const auto offset = reinterpret_cast<uintptr_t>(object) - reinterpret_cast<uintptr_t>(heap.active_half);
+        if (offset >= top || is_marked(heap, object)) {
+            return; // Temporaries and objects allocated during concurrent marking are not marked.
+        }
+        const ninja_object header = std::atomic_ref<ninja_object>(*object).load(std::memory_order_relaxed);
+        const size_t size = allocation_size(header.get_size(), header.is_compound());
+        mark_words(heap, offset / OBJECT_ALIGNMENT, size / OBJECT_ALIGNMENT);
+        heap.marked_objects++;
+        heap.marked_bytes += size;
+        if (header.is_compound()) {
+            heap.mark_stack.push_back(object);
+        }
+    }
+
+    /**
+     * Marks the members of all objects on the mark stack transitively,
+     * unless marking is cancelled.
+     */
+    static void trace(managed_heap &heap, size_t top) {
+        while (!heap.mark_stack.empty() && !heap.marking_cancelled.load(std::memory_order_relaxed)) {
+            ObjRef object = heap.mark_stack.back();
+            heap.mark_stack.pop_back();
+            for (size_t i = 0; i < object->get_size(); i++) {
+                ObjRef member = std::atomic_ref<ObjRef>(get_member(object, i)).load(std::memory_order_relaxed);
+                if (member != nil) {
+                    mark_object(heap, member, top);
+                }
+            }
+        }
+    }
+
+    /**
+     * Slides all marked objects towards the start of the heap, preserving
+     * their order. The bitmap yields their new locations, so references are
+     * updated before the objects are moved. Both passes find live objects in
+     * the bitmap, skipping garbage.
+     *
+     * Roots may refer to integer temporaries in the scratch arena, which are
+     * copied behind the live objects.
+     */
+    static void relocate_live_objects(VM &vm, const std::vector<ObjRef *> &temporaries) {
+        managed_heap &heap = vm.heap;
+        const size_t used_blocks = (heap.bytes_used + BLOCK_BYTES - 1) / BLOCK_BYTES;
+        const size_t used_words = heap.bytes_used / OBJECT_ALIGNMENT;
+
+        if (heap.config.allocprofile) {
+            for (const allocation_origin &origin: heap.allocation_origins) {
+                ObjRef object = reinterpret_cast<ObjRef>(heap.active_half + origin.offset);
+                if (is_marked(heap, object)) {
+                    record_survivor(heap, origin.offset, allocation_size(object->get_size(), object->is_compound()));
+                }
+            }
+        }
 
-        // Rescue objects stored in bip registers.
-        rescue(reinterpret_cast<ObjRef *>(&bip.op1));
-        rescue(reinterpret_cast<ObjRef *>(&bip.op2));
-        rescue(reinterpret_cast<ObjRef *>(&bip.res));
-        rescue(reinterpret_cast<ObjRef *>(&bip.rem));
-        // Rescue objects stored in return register.
-        rescue(&ret);
-        // Rescue objects stored in static data.
-        for (auto &entry: static_data) {
-            rescue(&entry);
+        // Compute the new offset of every block.
+        size_t offset = 0;
+        for (size_t block = 0; block < used_blocks; block++) {
+            heap.block_offsets[block] = offset;
+            offset += std::popcount(heap.live_words[block]) * OBJECT_ALIGNMENT;
         }
-        // Rescue objects stored on stack.
-        for (int32_t offset = 0; offset < sp; offset++) {
-            if (stack[offset].isObjRef) {
-                rescue(&stack[offset].as_reference());
+
+        // Objects before the first garbage, usually the oldest ones, stay in place.
+        size_t dense_words = 0;
+        while (dense_words < used_words && heap.live_words[dense_words / BLOCK_WORDS] == ~uint64_t{0}) {
+            dense_words += BLOCK_WORDS;
+        }
+        if (dense_words < used_words) {
+            dense_words += std::countr_one(heap.live_words[dense_words / BLOCK_WORDS]);
+        }
+        const unsigned char *dense_end = heap.active_half + dense_words * OBJECT_ALIGNMENT;
+
+        // Update references, while objects are still at their old location.
+        root_counts counted_before;
+        for_each_root(vm, counted_before, [&heap](ObjRef *root) {
+            if (in_heap(heap, *root)) {
+                *root = forward(heap, *root);
+            }
+        });
+        for (size_t word = next_live_word(heap, 0, used_words); word < used_words;
+             word = next_live_word(heap, word, used_words)) {
+            ObjRef object = reinterpret_cast<ObjRef>(heap.active_half + word * OBJECT_ALIGNMENT);
+            word += allocation_size(object->get_size(), object->is_compound()) / OBJECT_ALIGNMENT;
+            if (object->is_compound()) {
+                for (size_t i = 0; i < object->get_size(); i++) {
+                    ObjRef &member = get_member(object, i);
+                    if (member != nil && reinterpret_cast<unsigned char *>(member) >= dense_end) {
+                        member = forward(heap, member);
+                    }
+                }
+            }
+        }
+
+        // Move objects. Objects only move towards the start of the heap, so
+        // the headers of the objects following are not overwritten.
+        for (size_t word = next_live_word(heap, dense_words, used_words); word < used_words;
+             word = next_live_word(heap, word, used_words)) {
+            ObjRef object = reinterpret_cast<ObjRef>(heap.active_half + word * OBJECT_ALIGNMENT);
+            const size_t size = allocation_size(object->get_size(), object->is_compound());
+            std::memmove(forward(heap, object), object, size);
+            word += size / OBJECT_ALIGNMENT;
+        }
+        std::fill_n(heap.live_words.begin(), used_blocks, 0);
+        heap.bytes_used = heap.marked_bytes;
+        heap.allocations = heap.marked_objects;
+
+        // Temporaries are moved onto the heap.
+        for (ObjRef *root: temporaries) {
+            ObjRef temporary = *root;
+            if (temporary->is_copied()) {
+                *root = reinterpret_cast<ObjRef>(heap.active_half + temporary->get_size());
+                continue;
+            }
+            const size_t size = allocation_size(temporary->get_size(), temporary->is_compound());
+            if (size > heap.bytes_available - heap.bytes_used) {
+                throw std::runtime_error("Out of memory.");
+            }
+            ObjRef copied = allocate(heap, size);
+            std::memcpy(copied, temporary, size);
+            temporary->mark_copied(reinterpret_cast<unsigned char *>(copied) - heap.active_half);
+            *root = copied;
+        }
+
+        if (heap.config.gcpurge) {
+            std::memset(heap.active_half + heap.bytes_used, 0, heap.bytes_available - heap.bytes_used);
+        }
+    }
+
+    /**
+     * Marks all objects reachable from the roots and slides them towards the
+     * start of the heap.
+     */
+    static void compact_live_objects(VM &vm, root_counts &roots) {
+        managed_heap &heap = vm.heap;
+        heap.marked_objects = heap.marked_bytes = 0;
+        std::vector<ObjRef *> temporaries;
+        for_each_root(vm, roots, [&](ObjRef *root) {
+            if (in_heap(heap, *root)) {
+                mark_object(heap, *root, heap.bytes_used);
+            } else {
+                temporaries.push_back(root);
+            }
+        });
+        trace(heap, heap.bytes_used);
+        relocate_live_objects(vm, temporaries);
+    }
+
+    /**
+     * Marks the objects referenced by the roots and starts the marker thread
+     * marking all objects reachable from them. This is the initial pause of
+     * concurrent marking.
+     */
+    static void start_concurrent_marking(VM &vm) {
+        managed_heap &heap = vm.heap;
+        const auto start = std::chrono::steady_clock::now();
+        heap.marked_objects = heap.marked_bytes = 0;
+        heap.snapshot_top = heap.bytes_used;
+        root_counts roots;
+        for_each_root(vm, roots, [&heap](ObjRef *root) {
+            mark_object(heap, *root, heap.snapshot_top);
+        });
+
+        heap.marking = true;
+        heap.marking_done = false;
+        heap.marking_cancelled = false;
+        heap.marking_started = start;
+        heap.marker = std::thread([&heap]() {
+            trace(heap, heap.snapshot_top);
+            heap.marking_done.store(true, std::memory_order_release);
+        });
+
+        const uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+        heap.pause_times.push_back(pause);
+        if (heap.config.gcstats) {
+            std::cerr << "Concurrent marking started with " << heap.bytes_used << " bytes used (pause "
+                      << pause << " ns)." << std::endl;
+        }
+        if (heap.log.is_open()) {
+            heap.log << "{\"gc\":" << heap.pause_times.size()
+                     << ",\"phase\":\"initial\""
+                     << ",\"timestamp_us\":"
+                     << std::chrono::duration_cast<std::chrono::microseconds>(start - heap.initialized).count()
+                     << ",\"pause_ns\":" << pause
+                     << ",\"roots\":{\"stack\":" << roots.stack
+                     << ",\"static_data\":" << roots.static_data
+                     << ",\"bip\":" << roots.bip
+                     << ",\"ret\":" << roots.ret << "}"
+                     << ",\"heap_used\":" << heap.bytes_used
+                     << ",\"heap_size\":" << heap.bytes_available << "}\n";
+        }
+    }
+
+    /**
+     * Waits for the marker thread, then marks the objects it may have missed
+     * and compacts the heap. This is the final pause of concurrent marking.
+     */
+    static void finish_concurrent_marking(VM &vm, root_counts &roots) {
+        managed_heap &heap = vm.heap;
+        heap.marker.join();
+        heap.marking = false;
+        if (heap.config.gcstats) {
+            std::cerr << "Concurrent marking took "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now() - heap.marking_started).count()
+                      << " ns, " << (heap.bytes_used - heap.snapshot_top) << " bytes were allocated meanwhile."
+                      << std::endl;
+        }
+
+        // Objects reachable at the start of marking, whose references were overwritten.
+        const size_t top = heap.snapshot_top;
+        for (ObjRef overwritten: heap.satb_log) {
+            mark_object(heap, overwritten, top);
+        }
+        heap.satb_log.clear();
+        // Roots only refer to marked objects, unless they refer to temporaries or new objects.
+        std::vector<ObjRef *> temporaries;
+        for_each_root(vm, roots, [&](ObjRef *root) {
+            if (in_heap(heap, *root)) {
+                mark_object(heap, *root, top);
+            } else {
+                temporaries.push_back(root);
             }
+        });
+        trace(heap, top);
+
+        // Objects allocated during marking are live.
+        for (size_t position = top; position < heap.bytes_used;) {
+            ObjRef object = reinterpret_cast<ObjRef>(heap.active_half + position);
+            const size_t size = allocation_size(object->get_size(), object->is_compound());
+            mark_words(heap, position / OBJECT_ALIGNMENT, size / OBJECT_ALIGNMENT);
+            heap.marked_objects++;
+            heap.marked_bytes += size;
+            position += size;
         }
+        relocate_live_objects(vm, temporaries);
+    }
+
+    void gc(VM &vm) {
+        managed_heap &heap = vm.heap;
+        perf_begin(perf_scope::gc);
+        const auto start = std::chrono::steady_clock::now();
+        const size_t allocated_objects = heap.allocations, allocated_bytes = heap.bytes_used;
+        if (heap.config.gcstats) {
+            std::cerr << "Allocated since last gc: " << heap.allocations << " objects ("
+                      << heap.bytes_used << " bytes)." << std::endl;
+        }
+        root_counts roots;
+        const bool finishes_marking = heap.marking;
+        if (finishes_marking) {
+            finish_concurrent_marking(vm, roots);
+        } else if (heap.config.algorithm == gc_algorithm::copying) {
+            copy_live_objects(vm, roots);
+        } else {
+            compact_live_objects(vm, roots);
+        }
+        update_allocation_limit(heap);
+
+        // Survival of objects allocated before this collection is known now.
+        heap.allocation_origins.clear();
+        // Live temporaries were moved onto the heap.
+        heap.scratch_used = 0;
+
+        const auto end = std::chrono::steady_clock::now();
+        const uint64_t pause = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        heap.pause_times.push_back(pause);
+        perf_end(perf_scope::gc);
 
-        if (gcstats) {
-            std::cerr << "Live objects: " << allocations << " (" << bytes_used << " bytes)."
+        if (heap.config.gcstats) {
+            std::cerr << "Live objects: " << heap.allocations << " (" << heap.bytes_used << " bytes)."
                       << std::endl;
-            std::cerr << (bytes_available - bytes_used) << " bytes are available for use."
+            std::cerr << (heap.bytes_available - heap.bytes_used) << " bytes are available for use."
                       << std::endl;
         }
-        if (gcpurge) {
-            std::memset(unused_half, 0, bytes_available);
+        if (heap.log.is_open()) {
+            heap.log << "{\"gc\":" << heap.pause_times.size()
+                     << (finishes_marking ? ",\"phase\":\"final\"" : "")
+                     << ",\"timestamp_us\":"
+                     << std::chrono::duration_cast<std::chrono::microseconds>(start - heap.initialized).count()
+                     << ",\"pause_ns\":" << pause
+                     << ",\"allocated_objects\":" << allocated_objects
+                     << ",\"allocated_bytes\":" << allocated_bytes
+                     << ",\"objects_copied\":" << heap.allocations
+                     << ",\"bytes_copied\":" << heap.bytes_used
+                     << ",\"roots\":{\"stack\":" << roots.stack
+                     << ",\"static_data\":" << roots.static_data
+                     << ",\"bip\":" << roots.bip
+                     << ",\"ret\":" << roots.ret << "}"
+                     << ",\"heap_used\":" << heap.bytes_used
+                     << ",\"heap_size\":" << heap.bytes_available << "}\n";
         }
     }
 
 
-    [[nodiscard]] ObjRef halloc(size_t size) {
+    /**
+     * Returns the given percentile of the sorted pause times.
+     */
+    static uint64_t pause_percentile(const std::vector<uint64_t> &sorted, double percentile) {
+        if (sorted.empty()) {
+            return 0;
+        }
+        const auto rank = static_cast<size_t>(percentile / 100.0 * static_cast<double>(sorted.size() - 1) + 0.5);
+        return sorted[std::min(rank, sorted.size() - 1)];
+    }
+
+    /**
+     * Returns the peak resident set size of this process in kilobytes, or 0
+     * if it is unknown. Unlike getrusage, this excludes memory used by the
+     * parent process before it executed the machine.
+     */
+    static size_t peak_resident_kbytes() {
+        std::ifstream status("/proc/self/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.starts_with("VmHWM:")) {
+                return std::stoul(line.substr(6));
+            }
+        }
+        return 0;
+    }
+
+    void print_gc_summary(VM &vm, std::ostream &out) {
+        std::vector<uint64_t> sorted = vm.heap.pause_times;
+        std::ranges::sort(sorted);
+        const uint64_t total = std::accumulate(sorted.begin(), sorted.end(), uint64_t{0});
+
+        out << "Garbage collections: " << sorted.size() << " (" << total << " ns total)." << std::endl;
+        if (sorted.empty()) {
+            return;
+        }
+        out << "Pause times: p50 " << pause_percentile(sorted, 50)
+            << " ns, p99 " << pause_percentile(sorted, 99)
+            << " ns, max " << sorted.back() << " ns." << std::endl;
+
+        // Histogram with buckets doubling in size, starting at one microsecond.
+        uint64_t bucket_end = 1000;
+        for (auto pause = sorted.begin(); pause != sorted.end(); bucket_end *= 2) {
+            auto bucket_begin = pause;
+            pause = std::ranges::lower_bound(pause, sorted.end(), bucket_end);
+            if (pause != bucket_begin) {
+                out << "  < " << std::setw(10) << bucket_end / 1000 << " us: "
+                    << std::setw(8) << (pause - bucket_begin) << std::endl;
+            }
+        }
+
+        if (vm.heap.log.is_open()) {
+            vm.heap.log << "{\"summary\":{\"collections\":" << sorted.size()
+                        << ",\"total_ns\":" << total
+                        << ",\"p50_ns\":" << pause_percentile(sorted, 50)
+                        << ",\"p99_ns\":" << pause_percentile(sorted, 99)
+                        << ",\"max_ns\":" << sorted.back()
+                        << ",\"peak_rss_kb\":" << peak_resident_kbytes() << "}}\n";
+        }
+    }
+
+
+    [[nodiscard]] ObjRef halloc(VM &vm, size_t size) {
+        managed_heap &heap = vm.heap;
         if (size < object_size(0, false)) {
             throw std::invalid_argument("Cannot allocate object with less than zero members.");
         }
+        size = (size + OBJECT_ALIGNMENT - 1) & ~(OBJECT_ALIGNMENT - 1);
 
-        if (size > MAXIMUM_OBJECT_SIZE || size > bytes_available) {
+        if (size > MAXIMUM_OBJECT_SIZE || size > heap.bytes_available) {
             std::stringstream ss;
             ss << "Requested object of size " << size << " exceeds limits of heap.";
             throw std::invalid_argument(ss.str());
         }
 
-        if (size > (bytes_available - bytes_used)) {
+        if (size > heap.allocation_limit - heap.bytes_used && heap.config.algorithm == gc_algorithm::concurrent_mark) {
+            if (!heap.marking) {
+                start_concurrent_marking(vm);
+            } else if (heap.marking_done.load(std::memory_order_acquire)) {
+                gc(vm);
+            }
+        }
+        if (size > (heap.bytes_available - heap.bytes_used)) {
             // Not enough heap space available. Try to reclaim using garbage collection.
-            gc();
-            if (size > (bytes_available - bytes_used)) {
+            gc(vm);
+            if (size > (heap.bytes_available - heap.bytes_used)) {
                 // Still not enough heap space available, but no more space can be reclaimed.
                 throw std::runtime_error("Out of memory.");
             }
         }
 
-        return allocate(size);
+        ObjRef allocated = allocate(heap, size);
+        update_allocation_limit(heap);
+        if (heap.config.allocprofile) {
+            record_allocation(vm, allocated, size);
+        }
+        return allocated;
+    }
+
+
+    /**
+     * Prints a single row of the allocation profile.
+     */
+    static void print_allocation_row(std::ostream &out, const allocation_site &site, size_t total_bytes) {
+        out << std::setw(12) << site.objects
+            << std::setw(14) << site.bytes
+            << std::setw(8) << std::fixed << std::setprecision(1)
+            << (total_bytes == 0 ? 0.0 : 100.0 * static_cast<double>(site.bytes) / total_bytes) << "%"
+            << std::setw(12) << site.survived_bytes
+            << std::setw(9) << (site.bytes == 0 ? 0.0 : 100.0 * static_cast<double>(site.survived_bytes) / site.bytes)
+            << "%  " << std::defaultfloat;
+    }
+
+    void print_allocation_profile(const VM &vm, std::ostream &out) {
+        const std::vector<allocation_site> &allocation_sites = vm.heap.allocation_sites;
+        // Aggregate allocation sites by the opcode of their instruction.
+        std::vector<allocation_site> opcode_sites(opcode_count());
+        size_t total_bytes = 0;
+        for (size_t location = 0; location < allocation_sites.size(); location++) {
+            const allocation_site &site = allocation_sites[location];
+            allocation_site &by_opcode = opcode_sites[get_opcode(vm.program[location])];
+            by_opcode.objects += site.objects;
+            by_opcode.bytes += site.bytes;
+            by_opcode.survived_objects += site.survived_objects;
+            by_opcode.survived_bytes += site.survived_bytes;
+            total_bytes += site.bytes;
+        }
+
+        const auto ranked = [](const std::vector<allocation_site> &sites) {
+            std::vector<size_t> indices;
+            for (size_t index = 0; index < sites.size(); index++) {
+                if (sites[index].objects > 0) indices.push_back(index);
+            }
+            std::ranges::stable_sort(indices, [&sites](size_t a, size_t b) {
+                return sites[a].bytes > sites[b].bytes;
+            });
+            return indices;
+        };
+
+        out << "Allocation profile: " << total_bytes << " bytes allocated." << std::endl;
+        out << std::endl << std::left << std::setw(10) << "opcode" << std::right
+            << std::setw(12) << "objects" << std::setw(14) << "bytes" << std::setw(9) << "share"
+            << std::setw(12) << "survived" << std::setw(10) << "rate" << std::endl;
+        for (size_t opcode: ranked(opcode_sites)) {
+            out << std::left << std::setw(10) << info_for_opcode(opcode).name << std::right;
+            print_allocation_row(out, opcode_sites[opcode], total_bytes);
+            out << std::endl;
+        }
+
+        out << std::endl << std::left << std::setw(10) << "pc" << std::right
+            << std::setw(12) << "objects" << std::setw(14) << "bytes" << std::setw(9) << "share"
+            << std::setw(12) << "survived" << std::setw(10) << "rate" << "  instruction" << std::endl;
+        std::vector<size_t> sites = ranked(allocation_sites);
+        if (sites.size() > ALLOCATION_PROFILE_SITES) {
+            sites.resize(ALLOCATION_PROFILE_SITES);
+        }
+        for (size_t location: sites) {
+            out << std::left << std::setw(10) << location << std::right;
+            print_allocation_row(out, allocation_sites[location], total_bytes);
+            print_instruction(vm.program[location], out);
+        }
+    }
+
+
+    void restore_heap(VM &vm, const unsigned char *contents, size_t size) {
+        managed_heap &heap = vm.heap;
+        if (size > heap.bytes_available) {
+            std::stringstream ss;
+            ss << "Restored heap contents of " << size << " bytes exceed heap half of "
+               << heap.bytes_available << " bytes.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        stop_marking(heap);
+        std::memcpy(heap.active_half, contents, size);
+        heap.bytes_used = size;
+        heap.allocations = 0;
+        update_allocation_limit(heap);
     }
 }
\ No newline at end of file
@@ -5,10 +5,39 @@
  * Garbage collection and heap implementation for NJVM.
  */
 
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <thread>
+#include <atomic>
+
 #include "types.h"
 
 namespace NJVM {
 
+    /**
+     * Algorithm used to collect garbage.
+     */
+    enum class gc_algorithm {
+        /**
+         * Copy live objects into the unused half of the heap. Only half of
+         * the heap is available for allocations.
+         */
+        copying,
+        /**
+         * Mark live objects and slide them towards the start of the heap.
+         * The whole heap is available for allocations.
+         */
+        mark_compact,
+        /**
+         * Like mark_compact, but live objects are marked by a background
+         * thread while the program continues. The program only pauses to
+         * start marking and to compact the heap.
+         */
+        concurrent_mark,
+    };
+
     /**
      * Garbage collection and heap configuration.
      */
@@ -16,27 +45,281 @@ namespace NJVM {
         size_t heap_size_kbytes;
         bool gcstats;
         bool gcpurge;
+        bool allocprofile;
+        /**
+         * Path of the file receiving a JSON object per collection, or nullptr.
+         * An existing file is overwritten.
+         */
+        const char *gclog;
+        gc_algorithm algorithm;
+    };
+
+
+    /**
+     * Allocations attributed to a single instruction of the program.
+     */
+    struct allocation_site {
+        size_t objects = 0, bytes = 0;
+        size_t survived_objects = 0, survived_bytes = 0;
+    };
+
+    /**
+     * An object allocated in the active heap half since the last collection,
+     * identified by its offset to the start of the heap half.
+     */
+    struct allocation_origin {
+        size_t offset;
+        int32_t site;
+    };
+
+    /**
+     * Size of the scratch arena of a heap in bytes.
+     */
+    constexpr size_t SCRATCH_SIZE = 16 * 1024;
+
+    /**
+     * Heap of a single machine, managed by garbage collection.
+     */
+    struct managed_heap {
+        /**
+         * Configuration the heap was initialized with.
+         */
+        gc_config config{};
+        /**
+         * Memory holding both heap halves.
+         */
+        unsigned char *memory = nullptr;
+
+        // Heap is split into two halfs. The mark-compact collector uses a
+        // single half spanning the whole heap, the unused half is nullptr.
+        /**
+         * Pointer to active heap half.
+         */
+        unsigned char *active_half = nullptr,
+        /**
+         * Pointer to secondary heap half.
+         * Used to copy live objects during garbage collection.
+         */
+        *unused_half = nullptr;
+
+        /**
+         * Amount of bytes available per heap half.
+         *
+         * This value is not touched after initialization.
+         */
+        size_t bytes_available = 0,
+        /**
+         * Amount of bytes used in the currently active heap half.
+         */
+        bytes_used = 0;
+
+        /**
+         * Amount of allocations in the currently active heap half.
+         */
+        size_t allocations = 0;
+
+        /**
+         * Side tables of the mark-compact collector. A bit per 8 bytes of the
+         * heap marks the words covered by live objects. The offset table
+         * holds the new offset of the first live word in every block of 64
+         * words, so the new location of an object is found in constant time.
+         */
+        std::vector<uint64_t> live_words;
+        std::vector<size_t> block_offsets;
+        /**
+         * Compound objects marked, whose members are not marked yet.
+         */
+        std::vector<ObjRef> mark_stack;
+        size_t marked_objects = 0, marked_bytes = 0;
+
+        /**
+         * Allocations beyond this offset take the slow path. Concurrent
+         * marking uses it to start marking and check whether it finished.
+         */
+        size_t allocation_limit = 0;
+
+        /**
+         * State of concurrent marking. The marker thread marks all objects
+         * reachable at the start of marking, which are stored below the
+         * snapshot top. Objects allocated afterwards are live. The program
+         * logs references it overwrites in objects (snapshot at the
+         * beginning), so no object reachable at the start is missed.
+         */
+        bool marking = false;
+        size_t snapshot_top = 0;
+        std::vector<ObjRef> satb_log;
+        std::thread marker;
+        std::atomic<bool> marking_done = false, marking_cancelled = false;
+        std::chrono::steady_clock::time_point marking_started;
+
+        /**
+         * Arena holding integer temporaries, which are consumed by the next
+         * arithmetic, comparison or branch and never escape (see ir.h). The
+         * arena is reset whenever no temporary is live. Collections move
+         * live temporaries onto the heap, so the arena is empty afterwards.
+         */
+        alignas(OBJECT_ALIGNMENT) unsigned char scratch[SCRATCH_SIZE];
+        size_t scratch_used = 0;
+        /**
+         * Set while the interpreter executes an instruction whose integer
+         * results are temporaries.
+         */
+        bool allocate_scratch = false;
+
+        /**
+         * Structured log receiving a JSON object per collection, if requested.
+         * Pauses starting and finishing concurrent marking are logged with
+         * their phase, initial or final.
+         */
+        std::ofstream log;
+        /**
+         * Point in time the heap was initialized. Log timestamps are relative to it.
+         */
+        std::chrono::steady_clock::time_point initialized;
+        /**
+         * Duration of every collection performed in nanoseconds.
+         */
+        std::vector<uint64_t> pause_times;
+
+        /**
+         * Allocations attributed to each program location, when profiling.
+         */
+        std::vector<allocation_site> allocation_sites;
+        /**
+         * Origins of all objects allocated since the last collection. Objects
+         * are allocated consecutively, so this vector is sorted by offset.
+         */
+        std::vector<allocation_origin> allocation_origins;
+
+        managed_heap() = default;
+        managed_heap(const managed_heap &) = delete;
+        managed_heap &operator=(const managed_heap &) = delete;
+
+        /**
+         * Frees up the memory of this heap, if it is still allocated.
+         */
+        ~managed_heap();
     };
 
 
+    struct VM;
+
+    /**
+     * Initialize heap manager and garbage collection of a machine with the
+     * given configuration.
+     */
+    void initialize_heap(VM &vm, gc_config config);
+
+    /**
+     * Frees up the memory allocated in the heap of a machine.
+     */
+    void free_heap(VM &vm);
+
+    /**
+     * Discard all objects on the heap of a machine, keeping its memory for
+     * reuse. No references to the heap may remain afterwards.
+     */
+    void reset_heap(VM &vm);
+
+    /**
+     * Discard all temporaries in the scratch arena of a heap. Registers of
+     * the big integer processor referring to them are cleared, so they are
+     * not mistaken for live objects by the next collection.
+     */
+    inline void reset_scratch(managed_heap &heap) {
+        heap.scratch_used = 0;
+        for (void **reg: {&bip.op1, &bip.op2, &bip.res, &bip.rem}) {
+            const auto address = reinterpret_cast<uintptr_t>(*reg);
+            if (address - reinterpret_cast<uintptr_t>(heap.scratch) < SCRATCH_SIZE) {
+                *reg = nullptr;
+            }
+        }
+    }
+
+    /**
+     * Perform garbage collection on the heap of a machine. The machine must
+     * be the current machine of the calling thread, as the bip registers
+     * are rescued as well.
+     */
+    void gc(VM &vm);
+
+    /**
+     * Allocate an Object with the given amount of bytes on the heap of a machine.
+     * This is the slow path of allocations, collecting garbage if necessary.
+     * The size is rounded up to the object alignment.
+     */
+    [[nodiscard]] ObjRef halloc(VM &vm, size_t size);
+
+    /**
+     * Fast path of allocations, bumping the allocation pointer of the active
+     * heap half. Returns nil if the object does not fit below the allocation
+     * limit or allocations are profiled, in which case halloc is used. The
+     * size must be a multiple of the object alignment, see allocation_size.
+     */
+    [[nodiscard]] inline ObjRef bump_allocate(managed_heap &heap, size_t size) {
+        if (size > heap.allocation_limit - heap.bytes_used || heap.config.allocprofile) [[unlikely]] {
+            return nil;
+        }
+        auto allocated = reinterpret_cast<ObjRef>(heap.active_half + heap.bytes_used);
+        heap.bytes_used += size;
+        heap.allocations++;
+        return allocated;
+    }
+
+    /**
+     * Allocate a temporary in the scratch arena. Returns nil if it does not
+     * fit or allocations are profiled, in which case halloc is used. The size
+     * must be a multiple of the object alignment.
+     */
+    [[nodiscard]] inline ObjRef scratch_allocate(managed_heap &heap, size_t size) {
+        if (size > SCRATCH_SIZE - heap.scratch_used || heap.config.allocprofile) [[unlikely]] {
+            return nil;
+        }
+        auto allocated = reinterpret_cast<ObjRef>(heap.scratch + heap.scratch_used);
+        heap.scratch_used += size;
+        return allocated;
+    }
+
+    /**
+     * Store a reference into a member of an object. While marking
+     * concurrently, the overwritten reference is logged for the marker
+     * (snapshot at the beginning write barrier). The store is atomic, as
+     * the marker may read the member at the same time.
+     */
+    inline void store_member(managed_heap &heap, ObjRef &member, ObjRef value) {
+        if (heap.marking && member != nil) [[unlikely]] {
+            heap.satb_log.push_back(member);
+        }
+        std::atomic_ref<ObjRef>(member).store(value, std::memory_order_relaxed);
+    }
+
     /**
-     * Initialize heap manager and garbage collection with the given configuration.
+     * Prints the amount of collections performed together with percentiles
+     * and a histogram of their pause times. If a gc log was requested, the
+     * summary is written to it as well, after the line of the last collection.
      */
-    void initialize_heap(gc_config config);
+    void print_gc_summary(VM &vm, std::ostream &out);
 
     /**
-     * Frees up the memory allocated in the heap.
+     * Amount of allocation sites listed in an allocation profile report.
      */
-    void free_heap();
+    constexpr size_t ALLOCATION_PROFILE_SITES = 20;
 
     /**
-     * Perform garbage collection.
+     * Prints the allocations attributed to every instruction and opcode, ranked
+     * by the amount of bytes allocated. Survival rates describe the share of
+     * objects still alive during the garbage collection following their
+     * allocation.
+     *
+     * Allocations are only attributed if profiling was enabled in the gc_config.
      */
-    void gc();
+    void print_allocation_profile(const VM &vm, std::ostream &out);
 
     /**
-     * Allocate an Object with the given amount of bytes on the heap.
+     * Replace the contents of the active heap half with the given bytes. The
+     * contents must describe consecutively stored objects, whose references
+     * are updated by the caller afterwards.
      */
-    [[nodiscard]] ObjRef halloc(size_t size);
+    void restore_heap(VM &vm, const unsigned char *contents, size_t size);
 
-}
\ No newline at end of file
+}
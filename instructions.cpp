@@ -2,6 +2,8 @@
 #include <stdexcept>
 #include <iostream>
 #include <cstring>
+#include <cstddef>
+#include <algorithm>
 
 #include "instructions.h"
 #include "njvm.h"
@@ -9,65 +11,89 @@
 namespace NJVM {
     // Definition of every supported instruction.
     static constexpr instruction_info_t INSTRUCTION_DATA[] = {
-            {"halt",  false},
-
-            {"pushc", true},
-
-            {"add",   false},
-            {"sub",   false},
-            {"mul",   false},
-            {"div",   false},
-            {"mod",   false},
-
-            {"rdint", false},
-            {"wrint", false},
-            {"rdchr", false},
-            {"wrchr", false},
-
-            {"pushg", true},
-            {"popg",  true},
-
-            {"asf",   true},
-            {"rsf",   false},
-            {"pushl", true},
-            {"popl",  true},
-
-            {"eq",    false},
-            {"ne",    false},
-            {"lt",    false},
-            {"le",    false},
-            {"gt",    false},
-            {"ge",    false},
-
-            {"jmp",   true},
-            {"brf",   true},
-            {"brt",   true},
-
-            {"call",  true},
-            {"ret",   false},
-            {"drop",  true},
-            {"pushr", false},
-            {"popr",  false},
-
-            {"dup",   false},
-
-            {"new",   true},
-            {"getf",  true},
-            {"putf",  true},
-
-            {"newa",  false},
-            {"getfa", false},
-            {"putfa", false},
-            {"getsz", false},
-
-            {"pushn", false},
-            {"refeq", false},
-            {"refne", false},
+            {"halt",   false,  instruction_class::control},
+
+            {"pushc",  true,   instruction_class::stack},
+
+            {"add",    false,  instruction_class::arithmetic},
+            {"sub",    false,  instruction_class::arithmetic},
+            {"mul",    false,  instruction_class::arithmetic},
+            {"div",    false,  instruction_class::arithmetic},
+            {"mod",    false,  instruction_class::arithmetic},
+
+            {"rdint",  false,  instruction_class::io},
+            {"wrint",  false,  instruction_class::io},
+            {"rdchr",  false,  instruction_class::io},
+            {"wrchr",  false,  instruction_class::io},
+
+            {"pushg",  true,   instruction_class::variables},
+            {"popg",   true,   instruction_class::variables},
+
+            {"asf",    true,   instruction_class::control},
+            {"rsf",    false,  instruction_class::control},
+            {"pushl",  true,   instruction_class::variables},
+            {"popl",   true,   instruction_class::variables},
+
+            {"eq",     false,  instruction_class::comparison},
+            {"ne",     false,  instruction_class::comparison},
+            {"lt",     false,  instruction_class::comparison},
+            {"le",     false,  instruction_class::comparison},
+            {"gt",     false,  instruction_class::comparison},
+            {"ge",     false,  instruction_class::comparison},
+
+            {"jmp",    true,   instruction_class::control},
+            {"brf",    true,   instruction_class::control},
+            {"brt",    true,   instruction_class::control},
+
+            {"call",   true,   instruction_class::control},
+            {"ret",    false,  instruction_class::control},
+            {"drop",   true,   instruction_class::stack},
+            {"pushr",  false,  instruction_class::stack},
+            {"popr",   false,  instruction_class::stack},
+
+            {"dup",    false,  instruction_class::stack},
+
+            {"new",    true,   instruction_class::objects},
+            {"getf",   true,   instruction_class::objects},
+            {"putf",   true,   instruction_class::objects},
+
+            {"newa",   false,  instruction_class::objects},
+            {"getfa",  false,  instruction_class::objects},
+            {"putfa",  false,  instruction_class::objects},
+            {"getsz",  false,  instruction_class::objects},
+
+            {"pushn",  false,  instruction_class::stack},
+            {"refeq",  false,  instruction_class::comparison},
+            {"refne",  false,  instruction_class::comparison},
     };
     // Highest valid opcode. Computed at compile time.
     static constexpr opcode_t max_opcode = (sizeof(INSTRUCTION_DATA) / sizeof(instruction_info_t)) - 1;
 
 
+    [[nodiscard]] const char *class_name(instruction_class kind) {
+        switch (kind) {
+            case instruction_class::control:
+                return "control";
+            case instruction_class::arithmetic:
+                return "arithmetic";
+            case instruction_class::comparison:
+                return "comparison";
+            case instruction_class::io:
+                return "io";
+            case instruction_class::variables:
+                return "variables";
+            case instruction_class::stack:
+                return "stack";
+            case instruction_class::objects:
+                return "objects";
+        }
+        return "unknown";
+    }
+
+    [[nodiscard]] size_t opcode_count() {
+        return max_opcode + 1;
+    }
+
     [[nodiscard]] const instruction_info_t &info_for_opcode(opcode_t opcode) {
         if (opcode > max_opcode) {
             std::stringstream explanation;
@@ -78,20 +104,6 @@ namespace NJVM {
     }
 
 
-    [[nodiscard]] constexpr opcode_t get_opcode(instruction_t instruction) {
-        return (instruction >> 24) & 0xFF; // Opcode is encoded in the highest 8 bits.
-    }
-
-    [[nodiscard]] constexpr immediate_t get_immediate(instruction_t instruction) {
-        auto intermediate = static_cast<immediate_t>(instruction & 0x00FFFFFF); // Operand is encoded in lowest 24 bits.
-        if (intermediate & 0x00800000) {
-            // If original immediate was negative, fill remaining bits to extend sign.
-            intermediate |= (0xFF << 24);
-        }
-        return intermediate;
-    }
-
-
     // constexpr function to check if two C-strings are equal at compile time.
     static constexpr bool strequals(const char *s1, const char *s2) {
         for (size_t offset = 0; s1[offset] == s2[offset]; offset++) {
@@ -110,27 +122,72 @@ namespace NJVM {
     }
 
 
-    void print_instruction(instruction_t instruction) {
+    void print_instruction(instruction_t instruction, std::ostream &out) {
         const instruction_info_t &info = info_for_opcode(get_opcode(instruction));
-        std::cout << info.name;
+        out << info.name;
         if (info.requires_operand) {
-            std::cout << " " << get_immediate(instruction);
+            out << " " << get_immediate(instruction);
         }
-        std::cout << std::endl;
+        out << std::endl;
     }
 
     //-----------------------------------------------------------------------
     // Implementation of instruction execution.
     //-----------------------------------------------------------------------
 
-    // push and pop use vector implementation for automatic bounds checks.
+    /**
+     * Registers of the machine held in local variables by run_instructions,
+     * so the compiler does not need to store and reload them around calls.
+     */
+    struct cached_registers {
+        int32_t pc, sp, fp;
+        ObjRef ret;
+        stack_slot *stack;
+    };
+
+    // The garbage collector reads the registers from the machine, so cached registers are
+    // spilled before every call that may allocate. A collection may move the object in ret.
+
+    static inline void spill(const VM &, VM &) {}
+
+    static inline void reload(VM &, const VM &) {}
+
+    static inline void spill(const cached_registers &r, VM &vm) {
+        vm.pc = r.pc;
+        vm.sp = r.sp;
+        vm.fp = r.fp;
+        vm.ret = r.ret;
+    }
 
-    static inline stack_slot &push() {
-        return stack.at(sp++);
+    static inline void reload(cached_registers &r, const VM &vm) {
+        r.ret = vm.ret;
     }
 
-    static inline stack_slot &pop() {
-        return stack.at(--sp);
+    // push and pop access the stack unchecked, exceeding it hits a guard region (see stack.h).
+
+    template<typename Registers>
+    static inline stack_slot &push(Registers &r) {
+        return r.stack[r.sp++];
+    }
+
+    template<typename Registers>
+    static inline stack_slot &pop(Registers &r) {
+        return r.stack[--r.sp];
+    }
+
+    /**
+     * Slot of the local at the given offset from fp. Offsets beyond the
+     * guard regions are checked, growing the stack if necessary.
+     */
+    template<typename Registers>
+    static inline stack_slot &local(Registers &r, VM &vm, immediate_t offset) {
+        if (offset <= -GUARD_SLOTS || offset >= GUARD_SLOTS) [[unlikely]] {
+            if (r.fp + offset < 0) {
+                throw std::underflow_error("Stack underflow.");
+            }
+            return vm.stack.at(r.fp + offset);
+        }
+        return r.stack[r.fp + offset];
     }
 
 
@@ -144,12 +201,14 @@ namespace NJVM {
      * binary operation. The function parameter is a reference
      * to the bip-register holding the result of the operation.
      */
-    template<void Binary()>
-    static void do_arithmetic(void *&result_register) {
-        bip.op2 = pop().as_reference();
-        bip.op1 = pop().as_reference();
+    template<void Binary(), typename Registers>
+    static inline void do_arithmetic(Registers &r, VM &vm, void *&result_register) {
+        bip.op2 = pop(r).as_reference();
+        bip.op1 = pop(r).as_reference();
+        spill(r, vm);
         Binary();
-        push() = reinterpret_cast<ObjRef>(result_register);
+        reload(r, vm);
+        push(r) = reinterpret_cast<ObjRef>(result_register);
     }
 
     /**
@@ -165,250 +224,317 @@ namespace NJVM {
      * A single instance of the Comparator is initialized
      * for every specialization of this template function.
      */
-    template<typename Comparator>
-    static void do_comparison() {
+    template<typename Comparator, typename Registers>
+    static inline void do_comparison(Registers &r, VM &vm) {
         static Comparator cmp{}; // Instantiate Comparator once for every specialization.
 
-        bip.op2 = pop().as_reference();
-        bip.op1 = pop().as_reference();
+        bip.op2 = pop(r).as_reference();
+        bip.op1 = pop(r).as_reference();
         bool result = cmp(bigCmp(), 0);
-        push() = newNinjaInteger(result);
+        spill(r, vm);
+        push(r) = newNinjaInteger(result);
+        reload(r, vm);
+    }
+
+    /**
+     * Reads a local whose reference is copied, so the integer it refers to
+     * is no longer unique.
+     */
+    static inline ObjRef share_local(stack_slot &local) {
+        ObjRef value = local.as_reference();
+        if (value != nil && value->is_unique()) {
+            value->clear_unique();
+        }
+        return value;
+    }
+
+    /**
+     * Transfer control to the given target. Executed instructions are
+     * counted per straight-line segment ending here, so the interpreter
+     * loop does not need to count every instruction. The instruction
+     * budget is only checked at calls and backward transfers, as every
+     * loop passes one of them.
+     *
+     * @return false, if the machine was suspended as its budget is used up.
+     */
+    template<typename Registers>
+    static inline bool transfer(Registers &r, VM &vm, int32_t target, bool is_call) {
+        const bool backward = target < r.pc;
+        vm.executed += r.pc - vm.segment_start;
+        r.pc = vm.segment_start = target;
+        if ((backward || is_call)
+            && (vm.executed >= vm.instruction_limit || vm.suspend_requested.load(std::memory_order_relaxed))) {
+            vm.suspended = true;
+            return false;
+        }
+        return true;
     }
 
-    bool exec_instruction(instruction_t instruction) {
+    /**
+     * Execute a single instruction. The registers are either the machine
+     * itself, or copies held in local variables by run_instructions.
+     */
+    template<typename Registers>
+    [[gnu::always_inline]] static inline bool execute(Registers &r, VM &vm, instruction_t instruction) {
         switch (get_opcode(instruction)) {
             case opcode_for("halt"):
+                vm.executed += r.pc - vm.segment_start;
+                vm.segment_start = r.pc;
                 return false;
 
             case opcode_for("pushc"):
-                push() = newNinjaInteger(get_immediate(instruction));
+                spill(r, vm);
+                push(r) = newNinjaInteger(get_immediate(instruction));
+                reload(r, vm);
                 break;
 
             case opcode_for("add"):
-                do_arithmetic<bigAdd>(bip.res);
+                do_arithmetic<bigAdd>(r, vm, bip.res);
                 break;
 
             case opcode_for("sub"):
-                do_arithmetic<bigSub>(bip.res);
+                do_arithmetic<bigSub>(r, vm, bip.res);
                 break;
 
             case opcode_for("mul"):
-                do_arithmetic<bigMul>(bip.res);
+                do_arithmetic<bigMul>(r, vm, bip.res);
                 break;
 
             case opcode_for("div"):
-                do_arithmetic<bigDiv>(bip.res);
+                do_arithmetic<bigDiv>(r, vm, bip.res);
                 break;
 
             case opcode_for("mod"):
-                do_arithmetic<bigDiv>(bip.rem);
+                do_arithmetic<bigDiv>(r, vm, bip.rem);
                 break;
 
 
             case opcode_for("rdint"): {
-                bigRead(stdin);
-                push() = reinterpret_cast<ObjRef>(bip.res);
+                spill(r, vm);
+                bigRead(vm.input);
+                reload(r, vm);
+                push(r) = reinterpret_cast<ObjRef>(bip.res);
                 break;
             }
 
             case opcode_for("wrint"):
-                bip.op1 = pop().as_reference();
-                bigPrint(stdout);
+                bip.op1 = pop(r).as_reference();
+                bigPrint(vm.output);
                 break;
 
             case opcode_for("rdchr"): {
-                int32_t input;
-                std::cin >> reinterpret_cast<char &>(input);
-                push() = newNinjaInteger(input);
+                int input = fgetc(vm.input);
+                spill(r, vm);
+                push(r) = newNinjaInteger(input == EOF ? 0 : input); // End of input reads as 0.
+                reload(r, vm);
                 break;
             }
 
             case opcode_for("wrchr"):
-                bip.op1 = pop().as_reference();
-                std::cout << static_cast<char>(bigToInt());
+                bip.op1 = pop(r).as_reference();
+                fputc(static_cast<char>(bigToInt()), vm.output);
                 break;
 
 
             case opcode_for("pushg"):
-                push() = static_data.at(get_immediate(instruction));
+                push(r) = vm.static_data.at(get_immediate(instruction));
                 break;
 
             case opcode_for("popg"):
-                static_data.at(get_immediate(instruction)) = pop().as_reference();
+                vm.static_data.at(get_immediate(instruction)) = pop(r).as_reference();
                 break;
 
             case opcode_for("asf"): {
                 immediate_t size = get_immediate(instruction);
                 if (size < 0) throw std::invalid_argument("Frame size can't be negative.");
 
-                push() = fp;
-                fp = sp;
+                push(r) = r.fp;
+                r.fp = r.sp;
                 while (size--) { // Initialize stack frame.
-                    push() = nil;
+                    push(r) = nil;
                 }
                 break;
             }
 
             case opcode_for("rsf"):
-                sp = fp;
-                fp = pop().as_primitive();
+                r.sp = r.fp;
+                r.fp = pop(r).as_primitive();
+                // Locals are addressed relative to fp, which must stay within reach of the guard regions.
+                if (r.fp < 0 || r.fp > r.sp) throw std::underflow_error("Frame pointer is outside of the stack.");
                 break;
 
-            case opcode_for("pushl"):
-                push() = stack.at(fp + get_immediate(instruction)).as_reference();
+            case opcode_for("pushl"): {
+                stack_slot &slot = local(r, vm, get_immediate(instruction));
+                // Locals of translated programs may hold unique integers (see ir.h).
+                push(r) = vm.translation.empty() ? slot.as_reference() : share_local(slot);
                 break;
+            }
 
             case opcode_for("popl"):
-                stack.at(fp + get_immediate(instruction)) = pop().as_reference();
+                local(r, vm, get_immediate(instruction)) = pop(r).as_reference();
                 break;
 
 
             case opcode_for("eq"):
-                do_comparison<std::equal_to<int>>();
+                do_comparison<std::equal_to<int>>(r, vm);
                 break;
 
             case opcode_for("ne"):
-                do_comparison<std::not_equal_to<int>>();
+                do_comparison<std::not_equal_to<int>>(r, vm);
                 break;
 
             case opcode_for("lt"):
-                do_comparison<std::less<int>>();
+                do_comparison<std::less<int>>(r, vm);
                 break;
 
             case opcode_for("le"):
-                do_comparison<std::less_equal<int>>();
+                do_comparison<std::less_equal<int>>(r, vm);
                 break;
 
             case opcode_for("gt"):
-                do_comparison<std::greater<int>>();
+                do_comparison<std::greater<int>>(r, vm);
                 break;
 
             case opcode_for("ge"):
-                do_comparison<std::greater_equal<int>>();
+                do_comparison<std::greater_equal<int>>(r, vm);
                 break;
 
 
             case opcode_for("jmp"):
-                pc = get_immediate(instruction);
-                break;
+                return transfer(r, vm, get_immediate(instruction), false);
 
             case opcode_for("brf"):
-                bip.op1 = pop().as_reference();
-                if (bigToInt() == 0) pc = get_immediate(instruction);
+                bip.op1 = pop(r).as_reference();
+                if (bigToInt() == 0) return transfer(r, vm, get_immediate(instruction), false);
                 break;
 
             case opcode_for("brt"):
-                bip.op1 = pop().as_reference();
-                if (bigToInt() != 0) pc = get_immediate(instruction);
+                bip.op1 = pop(r).as_reference();
+                if (bigToInt() != 0) return transfer(r, vm, get_immediate(instruction), false);
                 break;
 
 
             case opcode_for("call"):
-                push() = pc;
-                pc = get_immediate(instruction);
-                break;
-
-            case opcode_for("ret"):
-                pc = pop().as_primitive();
-                break;
+                push(r) = r.pc;
+                return transfer(r, vm, get_immediate(instruction), true);
+
+            case opcode_for("ret"): {
+                const int32_t target = pop(r).as_primitive();
+                if (target == THREAD_EXIT) { // Function started by a thread returned.
+                    vm.executed += r.pc - vm.segment_start;
+                    vm.segment_start = r.pc;
+                    return false;
+                }
+                return transfer(r, vm, target, false);
+            }
 
             case opcode_for("drop"): {
                 immediate_t size = get_immediate(instruction);
                 if (size < 0) throw std::invalid_argument("Frame size can't be negative.");
-                if (static_cast<uint32_t>(size) > stack.size())
-                    throw std::overflow_error("Not enough elements on the stack for drop.");
+                if (size > r.sp)
+                    throw std::underflow_error("Not enough elements on the stack for drop.");
 
-                sp -= size;
+                r.sp -= size;
                 break;
             }
 
             case opcode_for("pushr"):
-                push() = ret;
-                ret = nil;
+                push(r) = r.ret;
+                r.ret = nil;
                 break;
 
             case opcode_for("popr"):
-                ret = pop().as_reference();
+                r.ret = pop(r).as_reference();
                 break;
 
 
             case opcode_for("dup"): {
-                ObjRef duplicated = stack.at(sp - 1).as_reference();
-                push() = duplicated;
+                ObjRef duplicated = r.stack[r.sp - 1].as_reference();
+                push(r) = duplicated;
                 break;
             }
 
 
             case opcode_for("new"): {
-                push() = newNinjaObject(get_immediate(instruction));
+                spill(r, vm);
+                push(r) = newNinjaObject(vm, get_immediate(instruction));
+                reload(r, vm);
                 break;
             }
 
             case opcode_for("getf"): {
-                ObjRef record = pop().as_reference();
+                ObjRef record = pop(r).as_reference();
                 immediate_t member = get_immediate(instruction);
 
-                push() = try_access_member(record, member);
+                push(r) = try_access_member(record, member);
                 break;
             }
 
             case opcode_for("putf"): {
-                ObjRef value = pop().as_reference();
-                ObjRef record = pop().as_reference();
+                ObjRef value = pop(r).as_reference();
+                ObjRef record = pop(r).as_reference();
                 immediate_t member = get_immediate(instruction);
 
-                try_access_member(record, member) = value;
+                store_member(vm.heap, try_access_member(record, member), value);
                 break;
             }
 
             case opcode_for("newa"): {
-                bip.op1 = pop().as_reference();
+                bip.op1 = pop(r).as_reference();
 
-                push() = newNinjaObject(bigToInt());
+                spill(r, vm);
+                push(r) = newNinjaObject(vm, bigToInt());
+                reload(r, vm);
                 break;
             }
 
             case opcode_for("getfa"): {
-                bip.op1 = pop().as_reference();
-                ObjRef array = pop().as_reference();
+                bip.op1 = pop(r).as_reference();
+                ObjRef array = pop(r).as_reference();
 
-                push() = try_access_member(array, bigToInt());
+                push(r) = try_access_member(array, bigToInt());
                 break;
             }
 
             case opcode_for("putfa"): {
-                ObjRef value = pop().as_reference();
-                bip.op1 = pop().as_reference();
-                ObjRef array = pop().as_reference();
+                ObjRef value = pop(r).as_reference();
+                bip.op1 = pop(r).as_reference();
+                ObjRef array = pop(r).as_reference();
 
-                try_access_member(array, bigToInt()) = value;
+                store_member(vm.heap, try_access_member(array, bigToInt()), value);
                 break;
             }
 
             case opcode_for("getsz"): {
-                ObjRef reference = pop().as_reference();
+                ObjRef reference = pop(r).as_reference();
+                spill(r, vm);
                 if (reference != nil && reference->is_compound()) {
-                    push() = newNinjaInteger(reference->get_size());
+                    push(r) = newNinjaInteger(reference->get_size());
                 } else {
-                    push() = newNinjaInteger(-1);
+                    push(r) = newNinjaInteger(-1);
                 }
+                reload(r, vm);
                 break;
             }
 
 
             case opcode_for("pushn"):
-                push() = nil;
+                push(r) = nil;
                 break;
 
             case opcode_for("refeq"): {
-                bool result = pop().as_reference() == pop().as_reference();
-                push() = newNinjaInteger(result);
+                bool result = pop(r).as_reference() == pop(r).as_reference();
+                spill(r, vm);
+                push(r) = newNinjaInteger(result);
+                reload(r, vm);
                 break;
             }
 
             case opcode_for("refne"): {
-                bool result = pop().as_reference() != pop().as_reference();
-                push() = newNinjaInteger(result);
+                bool result = pop(r).as_reference() != pop(r).as_reference();
+                spill(r, vm);
+                push(r) = newNinjaInteger(result);
+                reload(r, vm);
                 break;
             }
 
@@ -422,6 +548,235 @@ namespace NJVM {
         }
         return true;
     }
-}
 
+    bool exec_instruction(VM &vm, instruction_t instruction) {
+        return execute(vm, vm, instruction);
+    }
+
+    void run_instructions(VM &vm) {
+        cached_registers r{.pc = vm.pc, .sp = vm.sp, .fp = vm.fp, .ret = vm.ret, .stack = vm.stack.data()};
+        const instruction_t *program = vm.program.data();
+        const size_t program_size = vm.program.size();
+
+        try {
+            bool running;
+            do {
+                if (static_cast<uint32_t>(r.pc) >= program_size) [[unlikely]] {
+                    throw std::out_of_range("Program counter is outside of the program.");
+                }
+                const instruction_t instruction = program[r.pc]; // Fetch instruction.
+                r.pc++;                                          // Increment pc.
+                running = execute(r, vm, instruction);           // Execute instruction.
+            } while (running);
+        } catch (...) {
+            spill(r, vm);
+            throw;
+        }
+        spill(r, vm);
+    }
+
+
+    /**
+     * Performs the arithmetic instruction with the given opcode on the
+     * operands in bip.op1 and bip.op2, returning its result.
+     */
+    static inline ObjRef do_operation(opcode_t operation) {
+        switch (operation) {
+            case opcode_for("add"):
+                bigAdd();
+                return reinterpret_cast<ObjRef>(bip.res);
+            case opcode_for("sub"):
+                bigSub();
+                return reinterpret_cast<ObjRef>(bip.res);
+            case opcode_for("mul"):
+                bigMul();
+                return reinterpret_cast<ObjRef>(bip.res);
+            case opcode_for("div"):
+                bigDiv();
+                return reinterpret_cast<ObjRef>(bip.res);
+            default: // mod
+                bigDiv();
+                return reinterpret_cast<ObjRef>(bip.rem);
+        }
+    }
+
+    /**
+     * Compares the operands in bip.op1 and bip.op2 using the comparison
+     * instruction with the given opcode.
+     */
+    static inline bool do_compare(opcode_t operation) {
+        const int result = bigCmp();
+        switch (operation) {
+            case opcode_for("eq"):
+                return result == 0;
+            case opcode_for("ne"):
+                return result != 0;
+            case opcode_for("lt"):
+                return result < 0;
+            case opcode_for("le"):
+                return result <= 0;
+            case opcode_for("gt"):
+                return result > 0;
+            default: // ge
+                return result >= 0;
+        }
+    }
+
+    /**
+     * Returns the big integer stored in an integer object.
+     */
+    static inline const Big *as_big(void *object) {
+        return reinterpret_cast<const Big *>(reinterpret_cast<ObjRef>(object)->data);
+    }
+
+    /**
+     * Performs an arithmetic operation on bip.op1 and bip.op2, whose result
+     * is stored into the given local. If the local holds a unique integer
+     * with room for any possible result, that integer is dead. The result is
+     * computed in the scratch arena and copied into it, saving an allocation.
+     * Otherwise the new result is marked unique, as only the local refers to it.
+     */
+    static inline ObjRef do_local_operation(VM &vm, stack_slot *stack, int32_t local, opcode_t operation) {
+        const stack_slot &slot = stack[local];
+        ObjRef target = slot.isObjRef ? slot.u.reference : nil;
+        bool in_place = target != nil && target->is_unique();
+        if (in_place) {
+            const size_t digits1 = as_big(bip.op1)->nd, digits2 = as_big(bip.op2)->nd;
+            const size_t result_digits = operation == opcode_for("mul")
+                                         ? digits1 + digits2 : std::max(digits1, digits2) + 1;
+            in_place = target->get_size() >= offsetof(Big, digits) + result_digits;
+        }
+        if (!in_place) {
+            ObjRef result = do_operation(operation);
+            result->mark_unique();
+            return result;
+        }
+
+        vm.heap.allocate_scratch = true;
+        ObjRef result = do_operation(operation);
+        vm.heap.allocate_scratch = false;
+        target = stack[local].as_reference(); // Moved, if the arena was full and garbage was collected.
+        std::memcpy(target->data, result->data, offsetof(Big, digits) + as_big(result)->nd);
+        return target;
+    }
+
+    /**
+     * Allocates the constant operand b of an operation, which is consumed by
+     * the operation itself, in the scratch arena.
+     */
+    static inline ObjRef new_constant(VM &vm, const ir_instruction &operation) {
+        if (operation.scratch_empty) {
+            reset_scratch(vm.heap);
+        }
+        vm.heap.allocate_scratch = true;
+        ObjRef constant = newNinjaInteger(operation.b);
+        vm.heap.allocate_scratch = false;
+        return constant;
+    }
 
+    void run_translated(VM &vm) {
+        cached_registers r{.pc = vm.pc, .sp = vm.sp, .fp = vm.fp, .ret = vm.ret, .stack = vm.stack.data()};
+        const instruction_t *program = vm.program.data();
+        const ir_instruction *translation = vm.translation.data();
+        const size_t program_size = vm.program.size();
+        uint64_t dispatches = 0;
+
+        try {
+            bool running = true;
+            do {
+                if (static_cast<uint32_t>(r.pc) >= program_size) [[unlikely]] {
+                    throw std::out_of_range("Program counter is outside of the program.");
+                }
+                const ir_instruction &operation = translation[r.pc];
+                dispatches++;
+
+                switch (operation.opcode) {
+                    case ir_opcode::stack: {
+                        const instruction_t instruction = program[r.pc];
+                        r.pc++;
+                        if (operation.scratch) {
+                            if (operation.scratch_empty) {
+                                reset_scratch(vm.heap);
+                            }
+                            vm.heap.allocate_scratch = true;
+                            running = execute(r, vm, instruction);
+                            vm.heap.allocate_scratch = false;
+                        } else {
+                            running = execute(r, vm, instruction);
+                        }
+                        break;
+                    }
+
+                    case ir_opcode::push_local:
+                        r.stack[r.sp++] = share_local(r.stack[r.fp + operation.a]);
+                        r.pc += operation.length;
+                        break;
+
+                    case ir_opcode::move:
+                        r.stack[r.fp + operation.c] = share_local(r.stack[r.fp + operation.a]);
+                        r.pc += operation.length;
+                        break;
+
+                    case ir_opcode::load_constant: {
+                        spill(r, vm);
+                        ObjRef constant = newNinjaInteger(operation.a);
+                        reload(r, vm);
+                        r.stack[r.fp + operation.c] = constant;
+                        r.pc += operation.length;
+                        break;
+                    }
+
+                    case ir_opcode::arithmetic: {
+                        if (operation.scratch_empty) {
+                            reset_scratch(vm.heap);
+                        }
+                        bip.op1 = r.stack[r.fp + operation.a].as_reference();
+                        bip.op2 = r.stack[r.fp + operation.b].as_reference();
+                        spill(r, vm);
+                        ObjRef result = do_local_operation(vm, r.stack, r.fp + operation.c, operation.operation);
+                        reload(r, vm);
+                        r.stack[r.fp + operation.c] = result;
+                        r.pc += operation.length;
+                        break;
+                    }
+
+                    case ir_opcode::arithmetic_constant: {
+                        spill(r, vm);
+                        bip.op2 = new_constant(vm, operation);
+                        bip.op1 = r.stack[r.fp + operation.a].as_reference(); // Read after a possible collection.
+                        ObjRef result = do_local_operation(vm, r.stack, r.fp + operation.c, operation.operation);
+                        reload(r, vm);
+                        r.stack[r.fp + operation.c] = result;
+                        r.pc += operation.length;
+                        break;
+                    }
+
+                    case ir_opcode::branch:
+                    case ir_opcode::branch_constant: {
+                        if (operation.opcode == ir_opcode::branch) {
+                            bip.op2 = r.stack[r.fp + operation.b].as_reference();
+                        } else {
+                            spill(r, vm);
+                            bip.op2 = new_constant(vm, operation);
+                            reload(r, vm);
+                        }
+                        bip.op1 = r.stack[r.fp + operation.a].as_reference();
+                        const bool taken = do_compare(operation.operation) == operation.branch_if;
+                        r.pc += operation.length;
+                        if (taken) {
+                            running = transfer(r, vm, operation.c, false);
+                        }
+                        break;
+                    }
+                }
+            } while (running);
+        } catch (...) {
+            spill(r, vm);
+            vm.dispatches += dispatches;
+            vm.heap.allocate_scratch = false;
+            throw;
+        }
+        spill(r, vm);
+        vm.dispatches += dispatches;
+    }
+}
@@ -6,17 +6,38 @@
  */
 
 #include <cstdint>
+#include <iostream>
 #include "types.h"
 
 namespace NJVM {
 
     /**
-     * Struct holding the name of an instruction as well as a boolean flag
-     * encoding whether an operand is encoded as part of the instruction.
+     * Coarse classification of instructions, grouping them by the part of
+     * the machine they operate on.
+     */
+    enum class instruction_class {
+        control, arithmetic, comparison, io, variables, stack, objects
+    };
+
+    /**
+     * Amount of distinct instruction classes.
+     */
+    constexpr size_t INSTRUCTION_CLASS_COUNT = 7;
+
+    /**
+     * Returns a human readable name for the given instruction class.
+     */
+    [[nodiscard]] const char *class_name(instruction_class kind);
+
+    /**
+     * Struct holding the name of an instruction, a boolean flag encoding
+     * whether an operand is encoded as part of the instruction and the
+     * class the instruction belongs to.
      */
     struct instruction_info_t {
         const char *name;
         bool requires_operand;
+        instruction_class kind;
     };
 
     /**
@@ -24,6 +45,11 @@ namespace NJVM {
      */
     [[nodiscard]] const instruction_info_t &info_for_opcode(opcode_t opcode);
 
+    /**
+     * Returns the amount of opcodes known to this machine.
+     */
+    [[nodiscard]] size_t opcode_count();
+
     /**
      * Fetches the opcode for a given instruction mnemonic.
      *
@@ -36,25 +62,53 @@ namespace NJVM {
     /**
      * Extracts the opcode from an instruction.
      */
-    [[nodiscard]] constexpr opcode_t get_opcode(instruction_t instruction);
+    [[nodiscard]] constexpr opcode_t get_opcode(instruction_t instruction) {
+        return (instruction >> 24) & 0xFF; // Opcode is encoded in the highest 8 bits.
+    }
 
     /**
      * Extracts the immediate value (operand) from an instruction.
      */
-    [[nodiscard]] constexpr immediate_t get_immediate(instruction_t instruction);
+    [[nodiscard]] constexpr immediate_t get_immediate(instruction_t instruction) {
+        auto intermediate = static_cast<immediate_t>(instruction & 0x00FFFFFF); // Operand is encoded in lowest 24 bits.
+        if (intermediate & 0x00800000) {
+            // If original immediate was negative, fill remaining bits to extend sign.
+            intermediate |= (0xFF << 24);
+        }
+        return intermediate;
+    }
 
 
     /**
      * Prints a human readable representation of the given instruction to the
-     * standard output.
+     * given stream, which is the standard output by default.
      */
-    void print_instruction(instruction_t instruction);
+    void print_instruction(instruction_t instruction, std::ostream &out = std::cout);
+
+    struct VM;
 
     /**
-     * Executes the given instruction.
+     * Executes the given instruction on a machine, which has to be the
+     * current machine of the calling thread.
      *
-     * @return false, if the end of a program is reached, true otherwise.
+     * @return false, if the executing thread ended or the machine was
+     * suspended, true otherwise.
+     */
+    bool exec_instruction(VM &vm, instruction_t instruction);
+
+    /**
+     * Executes instructions starting at the pc of a machine, which has to be
+     * the current machine of the calling thread, until the executing thread
+     * ends or the machine is suspended. Unlike a loop over exec_instruction,
+     * the registers are kept in local variables and only stored to the
+     * machine where the garbage collector may read them, and on return.
+     */
+    void run_instructions(VM &vm);
+
+    /**
+     * Executes the translation of the program (see ir.h) like
+     * run_instructions, counting dispatched operations.
      */
-    bool exec_instruction(instruction_t instruction);
+    void run_translated(VM &vm);
 
 }
@@ -0,0 +1,179 @@
+
+#include <cstring>
+#include <stdexcept>
+
+#include "ir.h"
+#include "instructions.h"
+#include "stack.h"
+
+namespace NJVM {
+
+    /**
+     * Look up the opcode of an instruction by its mnemonic at runtime.
+     */
+    static opcode_t opcode_named(const char *name) {
+        for (opcode_t opcode = 0; opcode < opcode_count(); opcode++) {
+            if (std::strcmp(info_for_opcode(opcode).name, name) == 0) {
+                return opcode;
+            }
+        }
+        throw std::logic_error(std::string("Unknown instruction mnemonic ") + name);
+    }
+
+    /**
+     * Opcodes of the instructions taking part in translated sequences.
+     */
+    struct translated_opcodes {
+        opcode_t pushl = opcode_named("pushl"), popl = opcode_named("popl"), pushc = opcode_named("pushc");
+        opcode_t brf = opcode_named("brf"), brt = opcode_named("brt");
+        opcode_t refeq = opcode_named("refeq"), refne = opcode_named("refne");
+        opcode_t jmp = opcode_named("jmp"), call = opcode_named("call"), pushg = opcode_named("pushg");
+        opcode_t wrint = opcode_named("wrint"), wrchr = opcode_named("wrchr");
+
+        [[nodiscard]] static bool is_arithmetic(opcode_t opcode) {
+            return info_for_opcode(opcode).kind == instruction_class::arithmetic;
+        }
+
+        [[nodiscard]] bool is_comparison(opcode_t opcode) const {
+            // refeq and refne compare references, not integers.
+            return info_for_opcode(opcode).kind == instruction_class::comparison
+                   && opcode != refeq && opcode != refne;
+        }
+    };
+
+    /**
+     * Translate the sequence starting at the given instruction into a single
+     * operation, or keep the original instruction.
+     */
+    static ir_instruction translate_at(const std::vector<instruction_t> &program, size_t index,
+                                       const translated_opcodes &opcodes) {
+        const auto opcode_at = [&](size_t offset) -> int {
+            return index + offset < program.size() ? get_opcode(program[index + offset]) : -1;
+        };
+        const auto immediate_at = [&](size_t offset) {
+            return get_immediate(program[index + offset]);
+        };
+
+        // Locals beyond the reach of the guard regions are left to the checked stack instructions.
+        const auto near_at = [&](size_t offset) {
+            return (opcode_at(offset) != opcodes.pushl && opcode_at(offset) != opcodes.popl)
+                   || (immediate_at(offset) > -GUARD_SLOTS && immediate_at(offset) < GUARD_SLOTS);
+        };
+        if (!near_at(0)) {
+            return {};
+        }
+
+        if (opcode_at(0) == opcodes.pushc && opcode_at(1) == opcodes.popl && near_at(1)) {
+            return {.opcode = ir_opcode::load_constant, .length = 2, .a = immediate_at(0), .c = immediate_at(1)};
+        }
+        if (opcode_at(0) != opcodes.pushl) {
+            return {};
+        }
+        const ir_instruction push_local = {.opcode = ir_opcode::push_local, .a = immediate_at(0)};
+        if (!near_at(1)) {
+            return push_local;
+        }
+        if (opcode_at(1) == opcodes.popl) {
+            return {.opcode = ir_opcode::move, .length = 2, .a = immediate_at(0), .c = immediate_at(1)};
+        }
+        if (opcode_at(1) != opcodes.pushl && opcode_at(1) != opcodes.pushc) {
+            return push_local;
+        }
+
+        const bool constant = opcode_at(1) == opcodes.pushc;
+        const int operation = opcode_at(2);
+        if (operation >= 0 && translated_opcodes::is_arithmetic(operation) && opcode_at(3) == opcodes.popl
+            && near_at(3)) {
+            return {.opcode = constant ? ir_opcode::arithmetic_constant : ir_opcode::arithmetic, .length = 4,
+                    .operation = static_cast<opcode_t>(operation),
+                    .a = immediate_at(0), .b = immediate_at(1), .c = immediate_at(3)};
+        }
+        if (operation >= 0 && opcodes.is_comparison(operation)
+            && (opcode_at(3) == opcodes.brf || opcode_at(3) == opcodes.brt)) {
+            return {.opcode = constant ? ir_opcode::branch_constant : ir_opcode::branch, .length = 4,
+                    .operation = static_cast<opcode_t>(operation), .branch_if = opcode_at(3) == opcodes.brt,
+                    .a = immediate_at(0), .b = immediate_at(1), .c = immediate_at(3)};
+        }
+        return push_local;
+    }
+
+    /**
+     * Find the instruction consuming the integer produced by the instruction
+     * at the given index, if it is a temporary. Only pushes and operations
+     * consuming two integers may be executed between producer and consumer,
+     * as anything else may let the integer escape.
+     *
+     * @return the index of the consuming instruction, or 0 if the integer escapes.
+     */
+    static size_t find_consumer(const std::vector<instruction_t> &program, size_t index,
+                                const std::vector<bool> &jump_targets, const translated_opcodes &opcodes) {
+        size_t depth = 0; // Values pushed on top of the temporary.
+        for (size_t consumer = index + 1; consumer < program.size() && !jump_targets[consumer]; consumer++) {
+            const opcode_t opcode = get_opcode(program[consumer]);
+            if (opcode == opcodes.pushl || opcode == opcodes.pushc || opcode == opcodes.pushg) {
+                depth++;
+            } else if (translated_opcodes::is_arithmetic(opcode) || opcodes.is_comparison(opcode)) {
+                if (depth <= 1) {
+                    return consumer;
+                }
+                depth--; // Two values consumed, one produced.
+            } else if (opcode == opcodes.brf || opcode == opcodes.brt
+                       || opcode == opcodes.wrint || opcode == opcodes.wrchr) {
+                return depth == 0 ? consumer : 0;
+            } else {
+                return 0;
+            }
+        }
+        return 0;
+    }
+
+    /**
+     * Mark the operations producing temporaries and those executed while no
+     * temporary is live.
+     */
+    static void find_temporaries(const std::vector<instruction_t> &program, std::vector<ir_instruction> &translation,
+                                 const translated_opcodes &opcodes) {
+        // Execution may enter at jump targets and after calls, with unknown values on the stack.
+        std::vector<bool> jump_targets(program.size() + 1);
+        for (size_t index = 0; index < program.size(); index++) {
+            const opcode_t opcode = get_opcode(program[index]);
+            const immediate_t target = get_immediate(program[index]);
+            if ((opcode == opcodes.jmp || opcode == opcodes.brf || opcode == opcodes.brt || opcode == opcodes.call)
+                && target >= 0 && static_cast<size_t>(target) < program.size()) {
+                jump_targets[target] = true;
+            }
+            if (opcode == opcodes.call) {
+                jump_targets[index + 1] = true;
+            }
+        }
+
+        std::vector<size_t> live(program.size() + 1); // Temporaries live before each instruction.
+        for (size_t index = 0; index < program.size(); index++) {
+            const opcode_t opcode = get_opcode(program[index]);
+            if (opcode != opcodes.pushc && !translated_opcodes::is_arithmetic(opcode) && !opcodes.is_comparison(opcode)) {
+                continue;
+            }
+            const size_t consumer = find_consumer(program, index, jump_targets, opcodes);
+            if (consumer != 0) {
+                translation[index].scratch = true;
+                for (size_t covered = index + 1; covered <= consumer; covered++) {
+                    live[covered]++;
+                }
+            }
+        }
+        for (size_t index = 0; index < program.size(); index++) {
+            translation[index].scratch_empty = live[index] == 0;
+        }
+    }
+
+    std::vector<ir_instruction> translate_program(const std::vector<instruction_t> &program) {
+        const translated_opcodes opcodes;
+        std::vector<ir_instruction> translation;
+        translation.reserve(program.size());
+        for (size_t index = 0; index < program.size(); index++) {
+            translation.push_back(translate_at(program, index, opcodes));
+        }
+        find_temporaries(program, translation, opcodes);
+        return translation;
+    }
+}
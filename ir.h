@@ -0,0 +1,79 @@
+
+#pragma once
+
+/**
+ * Register-based intermediate representation of Ninja programs.
+ *
+ * Compiled Ninja code moves every value through the stack, so an assignment
+ * like c = a + b takes four instructions: pushl a, pushl b, add and popl c.
+ * The translation replaces such sequences by a single operation addressing
+ * the locals directly as registers relative to fp. Every other instruction
+ * is kept and executed by the stack interpreter.
+ *
+ * The translation holds one operation for every instruction of the
+ * program, so jump targets stay valid. An operation covering several
+ * instructions continues after the last of them, while a jump into the
+ * middle of such a sequence executes the operations of the remaining
+ * instructions on their own.
+ *
+ * The translation also finds integer temporaries: results of pushc,
+ * arithmetic and comparisons that are consumed by a later arithmetic,
+ * comparison, branch or write within the same straight-line sequence of
+ * pushes and operations. They never escape to locals, fields or static
+ * data, so they are allocated in the scratch arena of the heap (see gc.h)
+ * instead. Escaping values are allocated on the heap as usual.
+ *
+ * Integers computed by arithmetic operations are marked unique, as only the
+ * local receiving them refers to them. Operations only read locals, while
+ * push_local and move copy the reference and clear the mark. A unique
+ * integer in the local receiving a new result is dead, so the result is
+ * computed in the scratch arena and copied into it, if its digits fit.
+ */
+
+#include <vector>
+#include <cstdint>
+
+#include "types.h"
+
+namespace NJVM {
+
+    /**
+     * Kinds of operations of the intermediate representation.
+     */
+    enum class ir_opcode : uint8_t {
+        stack,               // Original instruction, executed by the stack interpreter.
+        push_local,          // push local[a], clearing its unique mark  pushl a
+        move,                // local[c] = local[a]              pushl a; popl c
+        load_constant,       // local[c] = a                     pushc a; popl c
+        arithmetic,          // local[c] = local[a] op local[b]  pushl a; pushl b; op; popl c
+        arithmetic_constant, // local[c] = local[a] op b         pushl a; pushc b; op; popl c
+        branch,              // local[a] cmp local[b], jump to c  pushl a; pushl b; cmp; brf/brt c
+        branch_constant,     // local[a] cmp b, jump to c         pushl a; pushc b; cmp; brf/brt c
+    };
+
+    /**
+     * A single operation of the intermediate representation.
+     */
+    struct ir_instruction {
+        ir_opcode opcode = ir_opcode::stack;
+        // Amount of original instructions covered by this operation.
+        uint8_t length = 1;
+        // Opcode of the arithmetic or comparison instruction, if any.
+        opcode_t operation = 0;
+        // Whether a branch is taken if the comparison holds (brt) or fails (brf).
+        bool branch_if = false;
+        // Whether integers allocated by this operation are temporaries.
+        bool scratch = false;
+        // Whether no temporary is live before this operation, so the scratch arena may be reset.
+        bool scratch_empty = false;
+        // Local offsets relative to fp, constants or jump targets, see ir_opcode.
+        int32_t a = 0, b = 0, c = 0;
+    };
+
+    /**
+     * Translate a program into the intermediate representation, holding one
+     * operation for every instruction.
+     */
+    [[nodiscard]] std::vector<ir_instruction> translate_program(const std::vector<instruction_t> &program);
+
+}
@@ -51,8 +51,9 @@
 
 /*
  * registers of the big integer processor
+ * every thread has its own set of registers
  */
-BIP bip = {
+__thread BIP bip = {
   NULL,		/* op1 */
   NULL,		/* op2 */
   NULL,		/* res */
@@ -35,7 +35,7 @@ typedef struct {
   BigObjRef rem;			/* remainder in case of division */
 } BIP;
 
-extern BIP bip;			/* registers of the processor */
+extern __thread BIP bip;		/* registers of the processor, one per thread */
 
 
 /* big integer processor functions */
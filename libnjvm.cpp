@@ -0,0 +1,185 @@
+
+#include <stdexcept>
+#include <algorithm>
+
+#include "libnjvm.h"
+#include "instructions.h"
+#include "loader.h"
+
+namespace NJVM {
+
+    /**
+     * Read function of a stream calling the read callback given as cookie.
+     */
+    static ssize_t read_callback(void *cookie, char *buffer, size_t size) {
+        return static_cast<ssize_t>(static_cast<io_callbacks *>(cookie)->read(buffer, size));
+    }
+
+    /**
+     * Write function of a stream calling the write callback given as cookie.
+     */
+    static ssize_t write_callback(void *cookie, const char *data, size_t size) {
+        static_cast<io_callbacks *>(cookie)->write(data, size);
+        return static_cast<ssize_t>(size);
+    }
+
+
+    machine::machine(const machine_config &config)
+            : stack_slots((config.stack_size_kbytes * 1024) / sizeof(stack_slot)),
+              maximum_stack_slots(std::max(config.stack_size_kbytes, config.maximum_stack_size_kbytes) * 1024 /
+                                  sizeof(stack_slot)),
+              thread_slice(config.thread_slice), translate(config.translate) {
+        // Initialize stack and heap for execution.
+        vm.stack = ninja_stack(stack_slots, maximum_stack_slots);
+        initialize_heap(vm, config.gc_config);
+    }
+
+    machine::~machine() {
+        close_redirections();
+    }
+
+    void machine::load(const unsigned char *binary, size_t size) {
+        NJVM::load(vm, binary, size);
+        vm.translation.clear();
+        vm.waiting_threads.clear();
+        vm.thread_id = 0;
+        vm.pc = vm.sp = vm.fp = 0;
+        vm.ret = nil;
+        vm.executed = 0;
+    }
+
+    void machine::load(const char *filename) {
+        NJVM::load(vm, filename);
+        vm.translation.clear();
+        vm.waiting_threads.clear();
+        vm.thread_id = 0;
+        vm.pc = vm.sp = vm.fp = 0;
+        vm.ret = nil;
+        vm.executed = 0;
+    }
+
+    void machine::reset() {
+        vm.waiting_threads.clear();
+        vm.thread_id = 0;
+        vm.pc = vm.sp = vm.fp = 0;
+        vm.ret = nil;
+        vm.bip = {nullptr, nullptr, nullptr, nullptr};
+        std::ranges::fill(vm.static_data, nil);
+        reset_heap(vm);
+        vm.executed = vm.dispatches = 0;
+    }
+
+    void machine::redirect_io(io_callbacks callbacks) {
+        close_redirections();
+        io = std::move(callbacks);
+
+        // Streams refer to the callbacks stored in this machine, so bigRead and bigPrint can use them.
+        if (io.read) {
+            redirected_input = fopencookie(&io, "r", {read_callback, nullptr, nullptr, nullptr});
+            if (redirected_input == nullptr) {
+                throw std::runtime_error("Unable to redirect input of machine.");
+            }
+            vm.input = redirected_input;
+        }
+        if (io.write) {
+            redirected_output = fopencookie(&io, "w", {nullptr, write_callback, nullptr, nullptr});
+            if (redirected_output == nullptr) {
+                throw std::runtime_error("Unable to redirect output of machine.");
+            }
+            vm.output = redirected_output;
+        }
+    }
+
+    void machine::close_redirections() {
+        if (redirected_input != nullptr) {
+            fclose(redirected_input);
+            redirected_input = nullptr;
+            vm.input = stdin;
+        }
+        if (redirected_output != nullptr) {
+            fclose(redirected_output); // Flushes remaining output to the callback.
+            redirected_output = nullptr;
+            vm.output = stdout;
+        }
+    }
+
+    uint32_t machine::spawn(int32_t entry, const std::vector<int32_t> &arguments) {
+        if (entry < 0 || static_cast<size_t>(entry) >= vm.program.size()) {
+            throw std::invalid_argument("Entry address of thread is outside of program.");
+        }
+
+        vm_scope scope(vm);
+        // The thread is known to the garbage collector, before its arguments are allocated.
+        ninja_thread &thread = vm.waiting_threads.emplace_back(ninja_thread{
+                .id = vm.next_thread_id++,
+                .stack = ninja_stack(stack_slots, maximum_stack_slots),
+                .pc = entry, .sp = 0, .fp = 0,
+                .ret = nil});
+        for (int32_t argument: arguments) {
+            ObjRef value = newNinjaInteger(argument);
+            thread.stack.at(thread.sp++) = value;
+        }
+        thread.stack.at(thread.sp++) = THREAD_EXIT;
+        return thread.id;
+    }
+
+    void machine::switch_thread(bool ended) {
+        if (!ended) {
+            vm.waiting_threads.push_back({
+                    .id = vm.thread_id,
+                    .stack = std::move(vm.stack),
+                    .pc = vm.pc, .sp = vm.sp, .fp = vm.fp,
+                    .ret = vm.ret});
+        }
+        ninja_thread &next = vm.waiting_threads.front();
+        vm.thread_id = next.id;
+        vm.stack = std::move(next.stack);
+        vm.pc = next.pc;
+        vm.sp = next.sp;
+        vm.fp = next.fp;
+        vm.ret = next.ret;
+        vm.waiting_threads.pop_front();
+        vm.segment_start = vm.pc;
+    }
+
+    run_result machine::run() {
+        return run(UINT64_MAX);
+    }
+
+    run_result machine::run(uint64_t instruction_budget) {
+        vm_scope scope(vm);
+        const uint64_t limit = vm.executed + std::min(instruction_budget, UINT64_MAX - vm.executed);
+        vm.suspend_requested = false;
+        vm.segment_start = vm.pc;
+        if (translate && vm.translation.size() != vm.program.size()) {
+            vm.translation = translate_program(vm.program); // Programs restored from snapshots are translated here.
+        }
+
+        while (true) {
+            // Time slices only apply while other threads are waiting.
+            vm.instruction_limit = vm.waiting_threads.empty()
+                                   ? limit : std::min(limit, vm.executed + std::min(thread_slice, UINT64_MAX - vm.executed));
+            vm.suspended = false;
+
+            run_guarded(vm.stack, [this]() {
+                if (vm.translation.empty()) {
+                    run_instructions(vm);
+                } else {
+                    run_translated(vm);
+                }
+            });
+
+            if (vm.suspended && (vm.executed >= limit || vm.suspend_requested.exchange(false))) {
+                fflush(vm.output);
+                return run_result::budget_exhausted;
+            }
+            if (!vm.suspended && vm.waiting_threads.empty()) {
+                fflush(vm.output);
+                return run_result::halted; // Last thread ended.
+            }
+            if (!vm.waiting_threads.empty()) {
+                switch_thread(!vm.suspended);
+            }
+        }
+    }
+}
@@ -0,0 +1,206 @@
+
+#pragma once
+
+/**
+ * Embedding interface of the NJVM, provided by the libnjvm library.
+ *
+ * A machine loads a Ninja binary from a file or from memory and executes
+ * it in the calling process. Input and output of the program can be
+ * redirected to callbacks, so programs can be run without touching the
+ * standard streams of the process. Every machine owns its stack and heap,
+ * so multiple machines can be used independently of each other.
+ *
+ * A machine may run multiple lightweight Ninja threads sharing its heap.
+ * Each thread has its own stack and registers. Threads are scheduled
+ * round-robin, switching at calls and backward jumps once a thread used
+ * up its time slice.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+
+#include "njvm.h"
+
+namespace NJVM {
+
+    /**
+     * Configuration of an embedded machine.
+     */
+    struct machine_config {
+        size_t stack_size_kbytes = DEFAULT_STACK_SIZE;
+        size_t maximum_stack_size_kbytes = DEFAULT_MAXIMUM_STACK_SIZE;
+        /**
+         * Amount of instructions a Ninja thread executes before others are scheduled.
+         */
+        uint64_t thread_slice = 10000;
+        /**
+         * Translate programs into the register-based representation of ir.h
+         * before running them.
+         */
+        bool translate = false;
+        NJVM::gc_config gc_config = {
+                .heap_size_kbytes = DEFAULT_HEAP_SIZE,
+                .gcstats = false,
+                .gcpurge = false,
+                .allocprofile = false,
+                .gclog = nullptr,
+                .algorithm = gc_algorithm::copying,
+        };
+    };
+
+    /**
+     * Callbacks receiving the input and output of a program.
+     */
+    struct io_callbacks {
+        /**
+         * Fill the given buffer with up to size bytes of input. Returns the
+         * amount of bytes read, which is 0 at the end of input.
+         */
+        std::function<size_t(char *buffer, size_t size)> read;
+        /**
+         * Receive size bytes of output.
+         */
+        std::function<void(const char *data, size_t size)> write;
+    };
+
+    /**
+     * Reason for a machine to stop running.
+     */
+    enum class run_result {
+        /**
+         * All threads of the program executed a halt instruction or returned
+         * from the function they were started with.
+         */
+        halted,
+        /**
+         * The instruction budget was used up or the machine was suspended.
+         * Running the machine again resumes execution.
+         */
+        budget_exhausted,
+    };
+
+    /**
+     * A Ninja Virtual Machine embedded into the calling process.
+     */
+    class machine {
+    public:
+        /**
+         * Create a machine, allocating stack and heap as configured.
+         */
+        explicit machine(const machine_config &config = {});
+
+        ~machine();
+
+        machine(const machine &) = delete;
+        machine &operator=(const machine &) = delete;
+
+        /**
+         * Load a Ninja binary held in memory, replacing the loaded program.
+         */
+        void load(const unsigned char *binary, size_t size);
+
+        /**
+         * Load a Ninja binary file, replacing the loaded program.
+         */
+        void load(const char *filename);
+
+        /**
+         * Reset the machine to the state after loading the program, so it can
+         * be run again. All objects are discarded, while the memory of stack
+         * and heap is kept for reuse.
+         */
+        void reset();
+
+        /**
+         * Redirect input and output of the program to the given callbacks.
+         * A callback left empty keeps the corresponding standard stream.
+         */
+        void redirect_io(io_callbacks callbacks);
+
+        /**
+         * Execute the loaded program until it halts.
+         */
+        run_result run();
+
+        /**
+         * Execute the loaded program, until it halts or the given amount of
+         * instructions is used up. The budget is checked at calls and backward
+         * jumps only, so a run may exceed it by the instructions executed until
+         * the next of these. Execution can be resumed by running the machine
+         * again.
+         */
+        run_result run(uint64_t instruction_budget);
+
+        /**
+         * Suspend the machine as soon as possible, as if its instruction
+         * budget was used up. This function may be called from any thread
+         * while the machine is running and affects the current run only.
+         */
+        void suspend() {
+            vm.suspend_requested.store(true, std::memory_order_relaxed);
+        }
+
+        /**
+         * Start a Ninja thread calling the function at the given entry address,
+         * as if the given integer arguments were pushed and the function was
+         * called. The thread ends, when the function returns or executes halt.
+         *
+         * @return the id of the started thread.
+         */
+        uint32_t spawn(int32_t entry, const std::vector<int32_t> &arguments = {});
+
+        /**
+         * Amount of Ninja threads that did not end yet, including the thread
+         * started at the program's entry point.
+         */
+        [[nodiscard]] size_t thread_count() const {
+            return vm.waiting_threads.size() + 1;
+        }
+
+        /**
+         * Amount of instructions executed since loading or resetting the machine.
+         */
+        [[nodiscard]] uint64_t executed_instructions() const {
+            return vm.executed;
+        }
+
+        /**
+         * Amount of operations dispatched by the interpreter since loading or
+         * resetting the machine. Translated programs dispatch fewer operations
+         * than they execute instructions.
+         */
+        [[nodiscard]] uint64_t dispatched_operations() const {
+            return vm.translation.empty() ? vm.executed : vm.dispatches;
+        }
+
+        /**
+         * The machine state, for tools inspecting or modifying it directly.
+         * The machine has to be entered using a vm_scope for this.
+         */
+        [[nodiscard]] VM &state() {
+            return vm;
+        }
+
+    private:
+        VM vm;
+        io_callbacks io;
+        size_t stack_slots, maximum_stack_slots;
+        uint64_t thread_slice;
+        bool translate;
+
+        /**
+         * Streams calling the io callbacks, or nullptr if not redirected.
+         */
+        FILE *redirected_input = nullptr, *redirected_output = nullptr;
+
+        void close_redirections();
+
+        /**
+         * Schedule the next waiting thread, letting the executing thread
+         * wait. If the executing thread ended, its state is discarded.
+         */
+        void switch_thread(bool ended);
+    };
+
+}
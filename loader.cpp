@@ -5,6 +5,7 @@
 #include <cstring>
 #include <stdexcept>
 #include <sstream>
+#include <vector>
 
 #include "njvm.h"
 #include "loader.h"
@@ -23,19 +24,12 @@ namespace NJVM {
         uint32_t static_vars_count;
     };
 
-    void load(const char *filename) {
-        FILE *input = fopen(filename, "rb"); // Open the file to read binary data.
-
-        if (input == nullptr) { // Failed to open file.
-            std::stringstream ss;
-            ss << "Unable to open file " << filename << ": " << std::strerror(errno);
-            throw std::invalid_argument(ss.str());
-        }
-
-        NJVM_file_header header; // Allocate header and read bytes into it.
-        if (fread(&header, sizeof(header), 1, input) != 1) {
+    void load(VM &vm, const unsigned char *binary, size_t size) {
+        NJVM_file_header header; // Allocate header and copy bytes into it.
+        if (size < sizeof(header)) {
             throw std::invalid_argument("Failed to read header from input file.");
         }
+        std::memcpy(&header, binary, sizeof(header));
 
         if (strncmp(header.magic, NJBF_MAGIC, NJBF_MAGIC_SIZE) != 0) { // Check if header starts with magic.
             throw std::invalid_argument("Invalid header in input file.");
@@ -45,17 +39,37 @@ namespace NJVM {
             throw std::invalid_argument("Unsupported binary version.");
         }
 
-        // Read instruction directly into memory, after allocating enough space.
-        program = std::vector<instruction_t>(header.instruction_count);
-        if (fread(program.data(), sizeof(instruction_t), header.instruction_count, input) !=
-            header.instruction_count) {
+        // Copy instructions directly into memory, after allocating enough space.
+        if ((size - sizeof(header)) / sizeof(instruction_t) < header.instruction_count) {
             throw std::invalid_argument("Failed to read program from input file.");
         }
+        vm.program = std::vector<instruction_t>(header.instruction_count);
+        std::memcpy(vm.program.data(), binary + sizeof(header), header.instruction_count * sizeof(instruction_t));
 
         // Allocate static data area and initialize with nil.
-        static_data = std::vector<ObjRef>(header.static_vars_count);
-        for (auto &entry: static_data) {
+        vm.static_data = std::vector<ObjRef>(header.static_vars_count);
+        for (auto &entry: vm.static_data) {
             entry = nil;
         }
     }
+
+    void load(VM &vm, const char *filename) {
+        FILE *input = fopen(filename, "rb"); // Open the file to read binary data.
+
+        if (input == nullptr) { // Failed to open file.
+            std::stringstream ss;
+            ss << "Unable to open file " << filename << ": " << std::strerror(errno);
+            throw std::invalid_argument(ss.str());
+        }
+
+        // Read the whole file, which is parsed from memory afterwards.
+        std::vector<unsigned char> binary;
+        unsigned char buffer[4096];
+        size_t count;
+        while ((count = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+            binary.insert(binary.end(), buffer, buffer + count);
+        }
+        fclose(input);
+        load(vm, binary.data(), binary.size());
+    }
 }
@@ -5,8 +5,12 @@
  * The program loader of the NJVM.
  */
 
+#include <cstddef>
+
 namespace NJVM {
 
+    struct VM;
+
     /**
      * Amount of bytes in ninja binary file's magic.
      */
@@ -18,7 +22,15 @@ namespace NJVM {
     constexpr char NJBF_MAGIC[NJBF_MAGIC_SIZE] = {'N', 'J', 'B', 'F'};
 
     /**
-     * Load a ninja binary file for execution into this VM.
+     * Load a ninja binary held in memory for execution into the given machine.
+     *
+     * @param binary Contents of a ninja binary file.
+     * @param size Amount of bytes in the binary.
+     */
+    void load(VM &vm, const unsigned char *binary, size_t size);
+
+    /**
+     * Load a ninja binary file for execution into the given machine.
      *
      * The binary file must start with the NJBF magic number and
      * defines how many objects are reserved for static data, as
@@ -26,6 +38,6 @@ namespace NJVM {
      *
      * @param filename C-style string of the path to the binary file to load.
      */
-    void load(const char *filename);
+    void load(VM &vm, const char *filename);
 
 }
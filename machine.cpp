@@ -0,0 +1,32 @@
+
+#include "njvm.h"
+
+namespace NJVM {
+    // Definition of NJVM constants.
+    const char *MESSAGE_START = "Ninja Virtual Machine started";
+    const char *MESSAGE_STOP = "Ninja Virtual Machine stopped";
+
+    /**
+     * Machine currently entered on this thread, or nullptr.
+     */
+    static thread_local VM *current_vm = nullptr;
+
+    [[nodiscard]] VM &VM::current() {
+        if (current_vm == nullptr) {
+            throw std::logic_error("No machine is entered on this thread.");
+        }
+        return *current_vm;
+    }
+
+
+    vm_scope::vm_scope(VM &vm) : vm(vm), previous(current_vm), previous_bip(bip) {
+        current_vm = &vm;
+        bip = vm.bip;
+    }
+
+    vm_scope::~vm_scope() {
+        vm.bip = bip;
+        bip = previous_bip;
+        current_vm = previous;
+    }
+}
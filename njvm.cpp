@@ -1,39 +1,36 @@
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <thread>
+#include <sstream>
 
 #include "njvm.h"
+#include "libnjvm.h"
 #include "instructions.h"
 #include "loader.h"
 #include "gc.h"
-
-namespace NJVM {
-    // Definition of NJVM constants and registers.
-    const char *MESSAGE_START = "Ninja Virtual Machine started";
-    const char *MESSAGE_STOP = "Ninja Virtual Machine stopped";
-
-    // Leave components default-initialized for now.
-    std::vector<instruction_t> program;
-    std::vector<ObjRef> static_data;
-    std::vector<stack_slot> stack;
-
-    // Initialize registers.
-    int32_t pc = 0, sp = 0, fp = 0;
-    ObjRef ret = nil;
-}
-
+#include "snapshot.h"
+#include "profiler.h"
+#include "perf.h"
+#include "batch.h"
 
 struct cli_config {
     bool requested_version = false;
     bool requested_help = false;
     bool requested_list = false;
-    size_t stack_size_kbytes = NJVM::DEFAULT_STACK_SIZE;
-    NJVM::gc_config gc_config = {
-            .heap_size_kbytes = NJVM::DEFAULT_HEAP_SIZE,
-            .gcstats = false,
-            .gcpurge = false,
+    NJVM::profiler_config profiler_config = {
+            .opcodes = false,
+            .call_graph_file = nullptr,
+            .symbols_file = nullptr,
     };
+    NJVM::machine_config machine_config = {};
     char *input_file = nullptr;
+    bool perfstats = false;
+    char *snapshot_in = nullptr;
+    char *snapshot_out = nullptr;
+    char *batch_manifest = nullptr;
+    unsigned jobs = 1;
+    uint64_t max_instructions = UINT64_MAX;
 };
 
 /**
@@ -45,7 +42,7 @@ int main(int argc, char *argv[]) {
     try {
         cli_config config = parse_arguments(argc, argv);
 
-        if (config.input_file == nullptr) {
+        if (config.input_file == nullptr && config.snapshot_in == nullptr && config.batch_manifest == nullptr) {
             config.requested_help = true; // Input file is required.
             std::cout << "No input file given!" << std::endl;
         }
@@ -66,8 +63,12 @@ int main(int argc, char *argv[]) {
             std::cout << "              Print a listing of the loaded program and exit. No\n";
             std::cout << "              instructions will be executed.\n";
             std::cout << " --stack SIZE\n";
-            std::cout << "              Sets the size of this machine's stack to SIZE kilobytes.\n";
+            std::cout << "              Sets the initial size of this machine's stack to SIZE\n";
+            std::cout << "              kilobytes. The stack grows on demand.\n";
             std::cout << "              Default is " << NJVM::DEFAULT_STACK_SIZE << "\n";
+            std::cout << " --max-stack SIZE\n";
+            std::cout << "              Sets the size this machine's stack may grow to in\n";
+            std::cout << "              kilobytes. Default is " << NJVM::DEFAULT_MAXIMUM_STACK_SIZE << "\n";
             std::cout << " --heap SIZE\n";
             std::cout << "              Sets the size of this machine's heap to SIZE kilobytes.\n";
             std::cout << "              Default is " << NJVM::DEFAULT_HEAP_SIZE << "\n";
@@ -76,6 +77,57 @@ int main(int argc, char *argv[]) {
             std::cout << "              all remains of collected objects.\n";
             std::cout << " --gcstats\n";
             std::cout << "              Display statistics with every garbage collection run.\n";
+            std::cout << " --gccompact\n";
+            std::cout << "              Collect garbage by sliding live objects to the start of\n";
+            std::cout << "              the heap instead of copying them between two halves, so\n";
+            std::cout << "              the whole heap is available for objects.\n";
+            std::cout << " --gcconcurrent\n";
+            std::cout << "              Like --gccompact, but live objects are marked by a\n";
+            std::cout << "              background thread while the program continues, so only\n";
+            std::cout << "              short pauses remain.\n";
+            std::cout << " --profile\n";
+            std::cout << "              Count executions and cycles per opcode and instruction.\n";
+            std::cout << "              A report is printed when the program halts.\n";
+            std::cout << " --callprofile FILE\n";
+            std::cout << "              Track calls and report cycles spent per function. Call\n";
+            std::cout << "              stacks are written to FILE in the collapsed format\n";
+            std::cout << "              used by flamegraph.pl.\n";
+            std::cout << " --symbols FILE\n";
+            std::cout << "              Name functions in profiles after the labels in FILE. This\n";
+            std::cout << "              is either the program's assembler source (*.asm) or holds\n";
+            std::cout << "              an address and a name per line.\n";
+            std::cout << " --perfstats\n";
+            std::cout << "              Count instructions, cycles, cache and branch misses of the\n";
+            std::cout << "              interpreter loop and garbage collection using hardware\n";
+            std::cout << "              performance counters. Cannot be combined with --profile\n";
+            std::cout << "              or --callprofile.\n";
+            std::cout << " --ir\n";
+            std::cout << "              Translate the program into a register-based representation\n";
+            std::cout << "              combining common instruction sequences. Not used when\n";
+            std::cout << "              profiling.\n";
+            std::cout << " --gclog FILE\n";
+            std::cout << "              Write a JSON object describing every garbage collection\n";
+            std::cout << "              to FILE, one per line. An existing FILE is overwritten.\n";
+            std::cout << " --allocprofile\n";
+            std::cout << "              Attribute allocated objects to the instructions causing\n";
+            std::cout << "              them and measure how many survive the next collection.\n";
+            std::cout << " --snapshot-out FILE\n";
+            std::cout << "              Write a snapshot of heap, static data and registers to\n";
+            std::cout << "              FILE once the program halts. Execution continues with\n";
+            std::cout << "              the instruction following halt when restored.\n";
+            std::cout << " --snapshot-in FILE\n";
+            std::cout << "              Restore the machine from a snapshot in FILE and resume\n";
+            std::cout << "              execution. The INPUT file may be omitted in this case.\n";
+            std::cout << " --max-instructions N\n";
+            std::cout << "              Abort the program once it executed N instructions. The\n";
+            std::cout << "              limit is checked at calls and backward jumps only.\n";
+            std::cout << " --batch MANIFEST\n";
+            std::cout << "              Execute all runs listed in MANIFEST and write their output\n";
+            std::cout << "              to separate files. Every program is loaded once and its\n";
+            std::cout << "              machine is reset between runs. No INPUT file is required.\n";
+            std::cout << " --jobs N\n";
+            std::cout << "              Distribute the runs of --batch across N threads. Default\n";
+            std::cout << "              is 1, 0 uses all processors.\n";
             std::cout << std::endl;
         }
         if (config.requested_help || config.requested_version) {
@@ -84,36 +136,67 @@ int main(int argc, char *argv[]) {
         }
 
         using namespace NJVM;
-        load(config.input_file); // Load program, initializing program and static_data.
+        if (config.batch_manifest != nullptr) {
+            const std::vector<batch_program> programs = read_manifest(config.batch_manifest);
+            const unsigned jobs = config.jobs == 0 ? std::max(1u, std::thread::hardware_concurrency()) : config.jobs;
+            return run_batch(programs, config.machine_config, jobs, std::cerr) == 0 ? 0 : 1;
+        }
+
+        machine machine(config.machine_config);
+        VM &vm = machine.state();
+        vm_scope scope(vm);
+        if (config.input_file != nullptr) {
+            machine.load(config.input_file); // Load program, initializing program and static_data.
+        }
+        if (config.snapshot_in != nullptr) {
+            load_snapshot(vm, config.snapshot_in);
+        }
 
         if (config.requested_list) {
-            for (const auto &instruction: program) {
+            for (const auto &instruction: vm.program) {
                 print_instruction(instruction);
             }
 
         } else {
-            const size_t stack_slot_count = (config.stack_size_kbytes * 1024) / sizeof(stack_slot);
-            // Initialize stack and heap for execution.
-            stack = std::vector<stack_slot>(stack_slot_count);
-            initialize_heap(config.gc_config);
-
             std::cout << MESSAGE_START << std::endl;
-            {
-                instruction_t instruction;
-                do {
-                    instruction = program.at(pc);        // Fetch instruction.
-                    pc++;                                // Increment pc.
-                } while (exec_instruction(instruction)); // Execute instruction.
+            initialize_profiler(config.profiler_config);
+            if (config.perfstats && initialize_perf_counters(std::cerr)) {
+                perf_begin(perf_scope::interpreter);
+            }
+            if (profiler_enabled()) {
+                vm.instruction_limit = config.max_instructions;
+                run_profiled(vm);
+            } else {
+                machine.run(config.max_instructions);
+            }
+            if (vm.suspended) {
+                std::stringstream ss;
+                ss << "Program exceeded the limit of " << config.max_instructions << " instructions.";
+                throw std::runtime_error(ss.str());
+            }
+            gc(vm); // Perform gc at end of execution to force it on small programs.
+            perf_end(perf_scope::interpreter); // Collections are part of the interpreter loop as well.
+            if (config.snapshot_out != nullptr) {
+                write_snapshot(vm, config.snapshot_out); // Only live objects remain after gc.
             }
-            gc(); // Perform gc at end of execution to force it on small programs.
             std::cout << MESSAGE_STOP << std::endl;
+            if (profiler_enabled()) {
+                print_profile(vm, std::cerr);
+            }
+            if (config.machine_config.gc_config.allocprofile) {
+                print_allocation_profile(vm, std::cerr);
+            }
+            if (config.machine_config.gc_config.gcstats || config.machine_config.gc_config.gclog != nullptr) {
+                print_gc_summary(vm, std::cerr);
+            }
+            if (config.perfstats) {
+                std::cerr << machine.executed_instructions() << " instructions executed in "
+                          << machine.dispatched_operations() << " dispatches." << std::endl;
+                print_perf_stats(std::cerr, machine.executed_instructions());
+                close_perf_counters();
+            }
         }
 
-        // Free up memory.
-        program.clear();
-        static_data.clear();
-        free_heap();
-
         return 0;
     } catch (std::exception &exception) {
         std::cerr << exception.what();
@@ -150,28 +233,118 @@ static cli_config parse_arguments(int argc, char *argv[]) {
             } else if (matches(arg, {"--list"})) {
                 config.requested_list = true;
 
+            } else if (matches(arg, {"--profile"})) {
+                config.profiler_config.opcodes = true;
+
+            } else if (matches(arg, {"--callprofile"})) {
+                if (argc > i + 1) {
+                    config.profiler_config.call_graph_file = argv[i + 1];
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --callprofile flag.");
+                }
+
+            } else if (matches(arg, {"--symbols"})) {
+                if (argc > i + 1) {
+                    config.profiler_config.symbols_file = argv[i + 1];
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --symbols flag.");
+                }
+
             } else if (matches(arg, {"--gcpurge"})) {
-                config.gc_config.gcpurge = true;
+                config.machine_config.gc_config.gcpurge = true;
 
             } else if (matches(arg, {"--gcstats"})) {
-                config.gc_config.gcstats = true;
+                config.machine_config.gc_config.gcstats = true;
+
+            } else if (matches(arg, {"--gccompact"})) {
+                config.machine_config.gc_config.algorithm = NJVM::gc_algorithm::mark_compact;
+
+            } else if (matches(arg, {"--gcconcurrent"})) {
+                config.machine_config.gc_config.algorithm = NJVM::gc_algorithm::concurrent_mark;
+
+            } else if (matches(arg, {"--perfstats"})) {
+                config.perfstats = true;
+
+            } else if (matches(arg, {"--ir"})) {
+                config.machine_config.translate = true;
+
+            } else if (matches(arg, {"--gclog"})) {
+                if (argc > i + 1) {
+                    config.machine_config.gc_config.gclog = argv[i + 1];
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --gclog flag.");
+                }
+
+            } else if (matches(arg, {"--allocprofile"})) {
+                config.machine_config.gc_config.allocprofile = true;
 
             } else if (matches(arg, {"--stack"})) {
                 if (argc > i + 1) {
-                    config.stack_size_kbytes = std::stoul(argv[i + 1]);
+                    config.machine_config.stack_size_kbytes = std::stoul(argv[i + 1]);
                     i++;
                 } else {
                     throw std::invalid_argument("Missing argument to --stack flag.");
                 }
 
+            } else if (matches(arg, {"--max-stack"})) {
+                if (argc > i + 1) {
+                    config.machine_config.maximum_stack_size_kbytes = std::stoul(argv[i + 1]);
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --max-stack flag.");
+                }
+
             } else if (matches(arg, {"--heap"})) {
                 if (argc > i + 1) {
-                    config.gc_config.heap_size_kbytes = std::stoul(argv[i + 1]);
+                    config.machine_config.gc_config.heap_size_kbytes = std::stoul(argv[i + 1]);
                     i++;
                 } else {
                     throw std::invalid_argument("Missing argument to --heap flag.");
                 }
 
+            } else if (matches(arg, {"--snapshot-in"})) {
+                if (argc > i + 1) {
+                    config.snapshot_in = argv[i + 1];
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --snapshot-in flag.");
+                }
+
+            } else if (matches(arg, {"--max-instructions"})) {
+                if (argc > i + 1) {
+                    config.max_instructions = std::stoull(argv[i + 1]);
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --max-instructions flag.");
+                }
+
+            } else if (matches(arg, {"--batch"})) {
+                if (argc > i + 1) {
+                    config.batch_manifest = argv[i + 1];
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --batch flag.");
+                }
+
+            } else if (matches(arg, {"--jobs"})) {
+                if (argc > i + 1) {
+                    config.jobs = std::stoul(argv[i + 1]);
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --jobs flag.");
+                }
+
+            } else if (matches(arg, {"--snapshot-out"})) {
+                if (argc > i + 1) {
+                    config.snapshot_out = argv[i + 1];
+                    i++;
+                } else {
+                    throw std::invalid_argument("Missing argument to --snapshot-out flag.");
+                }
+
 
             } else if (matches(arg, {"--"})) {
                 encountered_separator = true;
@@ -186,5 +359,10 @@ static cli_config parse_arguments(int argc, char *argv[]) {
         }
 
     }
+
+    // Profiling adds its own work to every instruction, which the counters would measure as well.
+    if (config.perfstats && (config.profiler_config.opcodes || config.profiler_config.call_graph_file != nullptr)) {
+        throw std::invalid_argument("--perfstats cannot be combined with --profile or --callprofile.");
+    }
     return config;
 }
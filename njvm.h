@@ -9,9 +9,15 @@
  */
 
 #include <vector>
+#include <deque>
 #include <stack>
+#include <cstdio>
+#include <atomic>
 
 #include "types.h"
+#include "gc.h"
+#include "stack.h"
+#include "ir.h"
 
 namespace NJVM {
 
@@ -21,22 +27,161 @@ namespace NJVM {
     constexpr uint32_t version = 8;
 
     /**
-     * Default size of stack and heap in kilobytes.
+     * Default size of stack and heap in kilobytes. The stack starts with the
+     * given size and grows on demand up to its maximum size.
      */
     constexpr size_t DEFAULT_HEAP_SIZE = 8192,
-            DEFAULT_STACK_SIZE = 64;
+            DEFAULT_STACK_SIZE = 16,
+            DEFAULT_MAXIMUM_STACK_SIZE = 1024 * 1024;
 
     // Message printed when starting/stopping the machine.
     extern const char *MESSAGE_START, *MESSAGE_STOP;
 
-    // Use a vector instead of raw memory. This gives us bounds checks for free.
-    extern std::vector<instruction_t> program;
-    extern std::vector<ObjRef> static_data;
-    extern std::vector<stack_slot> stack;
-    // 32-Bit integers for stack and program registers.
-    extern int32_t pc, sp, fp;
-    // Return register holds a reference.
-    extern ObjRef ret;
+    /**
+     * Return address of the function started by a Ninja thread. Returning to
+     * it ends the thread.
+     */
+    constexpr int32_t THREAD_EXIT = -1;
 
-}
+    /**
+     * Stack and registers of a Ninja thread, while it is waiting to be
+     * scheduled. The executing thread uses the registers of its machine.
+     */
+    struct ninja_thread {
+        uint32_t id;
+        ninja_stack stack;
+        int32_t pc, sp, fp;
+        ObjRef ret;
+    };
+
+    /**
+     * A single Ninja Virtual Machine, holding all components and registers.
+     *
+     * Machines are independent of each other, so a process may host many
+     * of them. Executing instructions of a machine requires it to be the
+     * current machine of the calling thread (see vm_scope), as the big
+     * integer library and allocations from it refer to the current machine.
+     */
+    struct VM {
+        // Use a vector instead of raw memory. This gives us bounds checks for free.
+        std::vector<instruction_t> program;
+        // Register-based translation of the program, empty if it is not translated.
+        std::vector<ir_instruction> translation;
+        std::vector<ObjRef> static_data;
+        // The stack grows on demand, guard regions catch accesses outside of it.
+        ninja_stack stack;
+        // 32-Bit integers for stack and program registers.
+        int32_t pc = 0, sp = 0, fp = 0;
+        // Return register holds a reference.
+        ObjRef ret = nil;
+        /**
+         * Streams read and written by the I/O instructions of the program.
+         */
+        FILE *input = stdin, *output = stdout;
+
+        /**
+         * Amount of instructions executed. Instructions are counted whenever
+         * control is transferred, for the straight-line segment starting at
+         * segment_start.
+         */
+        uint64_t executed = 0;
+        int32_t segment_start = 0;
+        /**
+         * Amount of operations dispatched by the interpreter of the translated
+         * program, which combines several instructions into one operation.
+         */
+        uint64_t dispatches = 0;
+        /**
+         * Once the amount of executed instructions reaches this limit, the
+         * machine is suspended at the next call or backward transfer of
+         * control.
+         */
+        uint64_t instruction_limit = UINT64_MAX;
+        /**
+         * Set by other threads to suspend the machine at the next call or
+         * backward transfer of control, like an exhausted limit. Cleared by
+         * the run it suspends.
+         */
+        std::atomic<bool> suspend_requested = false;
+        /**
+         * Set, if execution stopped because of the instruction limit.
+         */
+        bool suspended = false;
+
+        /**
+         * Id of the executing Ninja thread, with 0 being the thread started
+         * at the program's entry point.
+         */
+        uint32_t thread_id = 0, next_thread_id = 1;
+        /**
+         * Threads waiting to be scheduled, in round-robin order.
+         */
+        std::deque<ninja_thread> waiting_threads;
+        /**
+         * Registers of the big integer processor, while this machine is not
+         * the current machine of a thread.
+         */
+        BIP bip = {nullptr, nullptr, nullptr, nullptr};
+        /**
+         * Heap holding all objects of this machine.
+         */
+        managed_heap heap;
+
+        VM() = default;
+        VM(const VM &) = delete;
+        VM &operator=(const VM &) = delete;
 
+        /**
+         * Returns the current machine of the calling thread.
+         *
+         * This function fails if no machine was entered on this thread.
+         */
+        [[nodiscard]] static VM &current();
+    };
+
+    [[nodiscard]] inline ObjRef allocateIntegerObject(VM &vm, size_t byte_count) {
+        const size_t size = allocation_size(byte_count, false);
+        ObjRef result = vm.heap.allocate_scratch ? scratch_allocate(vm.heap, size) : bump_allocate(vm.heap, size);
+        if (result == nil) [[unlikely]] {
+            result = halloc(vm, size);
+        }
+        result->size = byte_count;
+        result->flags = 0;
+        result->age = 0;
+        result->hash = 0;
+        return result;
+    }
+
+    [[nodiscard]] inline ObjRef allocateCompoundObject(VM &vm, size_t member_count) {
+        const size_t size = allocation_size(member_count, true);
+        ObjRef result = bump_allocate(vm.heap, size);
+        if (result == nil) [[unlikely]] {
+            result = halloc(vm, size);
+        }
+        result->size = member_count;
+        result->flags = COMPOUND_FLAG;
+        result->age = 0;
+        result->hash = 0;
+        return result;
+    }
+
+    /**
+     * Makes a machine the current machine of the calling thread for the
+     * lifetime of this object. The big integer registers of the machine are
+     * swapped into the thread's big integer processor and are stored back
+     * into the machine afterwards. Scopes may be nested.
+     */
+    struct vm_scope {
+        VM &vm;
+        VM *previous;
+        BIP previous_bip;
+
+        explicit vm_scope(VM &vm);
+
+        ~vm_scope();
+
+        vm_scope(const vm_scope &) = delete;
+        vm_scope &operator=(const vm_scope &) = delete;
+    };
+
+}
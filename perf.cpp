@@ -0,0 +1,151 @@
+
+#include <cstring>
+#include <cerrno>
+#include <iomanip>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+namespace NJVM {
+
+    /**
+     * Hardware events counted by every group, in the order they are read.
+     */
+    static constexpr uint64_t PERF_EVENTS[] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+    };
+    static constexpr size_t PERF_EVENT_COUNT = sizeof(PERF_EVENTS) / sizeof(PERF_EVENTS[0]);
+    static constexpr size_t PERF_SCOPE_COUNT = 2;
+
+    /**
+     * Group of counters, read together through the group leader.
+     */
+    struct perf_group {
+        int descriptors[PERF_EVENT_COUNT] = {-1, -1, -1, -1};
+        uint64_t values[PERF_EVENT_COUNT] = {};
+    };
+
+    // Counters measure the calling thread only, so every thread opens its own.
+    static thread_local bool perf_available = false;
+    static thread_local perf_group groups[PERF_SCOPE_COUNT];
+
+
+    /**
+     * Open a single counter. The first counter of a group is passed -1 as
+     * leader and starts disabled, so the whole group can be enabled at once.
+     */
+    static int open_counter(uint64_t event, int leader) {
+        perf_event_attr attributes{};
+        attributes.size = sizeof(attributes);
+        attributes.type = PERF_TYPE_HARDWARE;
+        attributes.config = event;
+        attributes.disabled = leader == -1;
+        attributes.exclude_kernel = 1;
+        attributes.exclude_hv = 1;
+        attributes.read_format = PERF_FORMAT_GROUP;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attributes, 0, -1, leader, 0));
+    }
+
+    bool initialize_perf_counters(std::ostream &diagnostics) {
+        for (perf_group &group: groups) {
+            for (size_t event = 0; event < PERF_EVENT_COUNT; event++) {
+                group.descriptors[event] = open_counter(PERF_EVENTS[event], group.descriptors[0]);
+                if (group.descriptors[event] < 0) {
+                    diagnostics << "Hardware performance counters are not available: "
+                                << std::strerror(errno) << std::endl;
+                    close_perf_counters();
+                    return false;
+                }
+            }
+        }
+        perf_available = true;
+        return true;
+    }
+
+    void perf_begin(perf_scope scope) {
+        if (perf_available) {
+            ioctl(groups[static_cast<size_t>(scope)].descriptors[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    void perf_end(perf_scope scope) {
+        if (perf_available) {
+            ioctl(groups[static_cast<size_t>(scope)].descriptors[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    /**
+     * Read the values of all counters in a group.
+     */
+    static void read_group(perf_group &group) {
+        uint64_t buffer[1 + PERF_EVENT_COUNT]; // Amount of values followed by the values.
+        if (read(group.descriptors[0], buffer, sizeof(buffer)) == sizeof(buffer)) {
+            std::memcpy(group.values, buffer + 1, sizeof(group.values));
+        }
+    }
+
+    /**
+     * Prints a row of counted events for a single scope.
+     */
+    static void print_row(std::ostream &out, const char *name, const uint64_t *values, uint64_t executed_instructions) {
+        const auto ratio = [](uint64_t dividend, uint64_t divisor) {
+            return divisor == 0 ? 0.0 : static_cast<double>(dividend) / static_cast<double>(divisor);
+        };
+        out << std::left << std::setw(14) << name << std::right
+            << std::setw(16) << values[1]
+            << std::setw(16) << values[0]
+            << std::setw(8) << std::fixed << std::setprecision(2) << ratio(values[1], values[0])
+            << std::setw(14) << values[2]
+            << std::setw(14) << values[3]
+            << std::setw(12) << ratio(values[1], executed_instructions)
+            << std::setw(10) << ratio(values[0], executed_instructions)
+            << std::setw(10) << std::setprecision(4) << ratio(values[2], executed_instructions)
+            << std::setw(10) << ratio(values[3], executed_instructions)
+            << std::defaultfloat << std::endl;
+    }
+
+    void print_perf_stats(std::ostream &out, uint64_t executed_instructions) {
+        if (!perf_available) {
+            return;
+        }
+        perf_group &interpreter = groups[static_cast<size_t>(perf_scope::interpreter)];
+        perf_group &gc = groups[static_cast<size_t>(perf_scope::gc)];
+        read_group(interpreter);
+        read_group(gc);
+
+        // The interpreter loop includes collections, which are reported separately as well.
+        uint64_t mutator[PERF_EVENT_COUNT];
+        for (size_t event = 0; event < PERF_EVENT_COUNT; event++) {
+            mutator[event] = interpreter.values[event] - std::min(interpreter.values[event], gc.values[event]);
+        }
+
+        out << "Performance counters for " << executed_instructions << " executed instructions:" << std::endl;
+        out << std::left << std::setw(14) << "scope" << std::right
+            << std::setw(16) << "instructions" << std::setw(16) << "cycles" << std::setw(8) << "IPC"
+            << std::setw(14) << "cache-misses" << std::setw(14) << "branch-misses"
+            << std::setw(12) << "instr/op" << std::setw(10) << "cyc/op"
+            << std::setw(10) << "cache/op" << std::setw(10) << "branch/op" << std::endl;
+        print_row(out, "interpreter", interpreter.values, executed_instructions);
+        print_row(out, "mutator", mutator, executed_instructions);
+        print_row(out, "gc", gc.values, executed_instructions);
+    }
+
+    void close_perf_counters() {
+        for (perf_group &group: groups) {
+            for (int &descriptor: group.descriptors) {
+                if (descriptor >= 0) {
+                    close(descriptor);
+                }
+                descriptor = -1;
+            }
+        }
+        perf_available = false;
+    }
+}
@@ -0,0 +1,53 @@
+
+#pragma once
+
+/**
+ * Hardware performance counters of the NJVM.
+ *
+ * Linux perf_event counters are opened for instructions, cycles, cache
+ * misses and branch misses. They are counted separately while running
+ * the interpreter loop and while collecting garbage.
+ */
+
+#include <cstdint>
+#include <iostream>
+
+namespace NJVM {
+
+    /**
+     * Parts of the machine measured by separate groups of counters.
+     */
+    enum class perf_scope {
+        interpreter, gc
+    };
+
+    /**
+     * Open the hardware counters. Returns false and prints the reason to
+     * the given stream if they are not available on this machine, in which
+     * case all other functions of this header do nothing.
+     */
+    bool initialize_perf_counters(std::ostream &diagnostics);
+
+    /**
+     * Start counting events for the given scope.
+     */
+    void perf_begin(perf_scope scope);
+
+    /**
+     * Stop counting events for the given scope. Counts accumulate over
+     * multiple pairs of perf_begin and perf_end.
+     */
+    void perf_end(perf_scope scope);
+
+    /**
+     * Prints the counted events of both scopes, including instructions per
+     * cycle and the amount of events per executed Ninja instruction.
+     */
+    void print_perf_stats(std::ostream &out, uint64_t executed_instructions);
+
+    /**
+     * Close all hardware counters.
+     */
+    void close_perf_counters();
+
+}
@@ -0,0 +1,408 @@
+
+#include <vector>
+#include <map>
+#include <string>
+#include <numeric>
+#include <algorithm>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cctype>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profiler.h"
+#include "instructions.h"
+#include "njvm.h"
+
+namespace NJVM {
+
+    /**
+     * Counters collected for an opcode, instruction class or program location.
+     */
+    struct profile_entry {
+        uint64_t executions = 0;
+        uint64_t cycles = 0;
+    };
+
+    /**
+     * Node in the tree of observed call stacks. Every node represents a
+     * function called from the stack described by its parent.
+     */
+    struct call_node {
+        int32_t entry;
+        size_t parent;
+        uint64_t exclusive_cycles = 0;
+        std::map<int32_t, size_t> children = {};
+    };
+
+    /**
+     * A function currently executing, referring to its node in the call tree.
+     */
+    struct call_frame {
+        size_t node;
+        uint64_t start;
+        uint64_t child_cycles;
+    };
+
+    /**
+     * Counters collected for a function, identified by its entry address.
+     */
+    struct function_entry {
+        uint64_t calls = 0;
+        uint64_t inclusive_cycles = 0;
+        uint64_t exclusive_cycles = 0;
+        uint32_t active = 0; // Amount of frames on the call stack, so recursion is counted once.
+    };
+
+    // The profile is collected per thread, for the machine run on it.
+    static thread_local profiler_config configuration{};
+    static thread_local opcode_t call_opcode, ret_opcode;
+
+    // Counters are sized once the profiled program is known.
+    static thread_local std::vector<profile_entry> opcode_profile, location_profile;
+
+    static thread_local std::vector<call_node> call_tree;
+    static thread_local std::vector<call_frame> call_stack;
+    static thread_local std::map<int32_t, function_entry> function_profile;
+    static thread_local std::map<int32_t, std::string> symbols;
+
+
+    [[nodiscard]] uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+
+    /**
+     * Returns true if the given filename ends with the given extension.
+     */
+    static bool has_extension(const char *filename, const char *extension) {
+        const size_t length = strlen(filename), extension_length = strlen(extension);
+        return length >= extension_length && strcmp(filename + length - extension_length, extension) == 0;
+    }
+
+    /**
+     * Read labels from an assembler source file. The address of a label is
+     * the amount of instructions preceding it.
+     */
+    static void read_assembler_symbols(std::istream &input) {
+        int32_t address = 0;
+        std::string line;
+        while (std::getline(input, line)) {
+            line = line.substr(0, line.find("//")); // Strip comments.
+
+            size_t position = line.find_first_not_of(" \t\r");
+            size_t label_end = position;
+            while (label_end < line.size() && (isalnum(line[label_end]) || line[label_end] == '_')) {
+                label_end++;
+            }
+            if (label_end > position && label_end < line.size() && line[label_end] == ':') {
+                symbols.emplace(address, line.substr(position, label_end - position));
+                position = line.find_first_not_of(" \t\r", label_end + 1);
+            }
+
+            if (position != std::string::npos && line[position] != '.') {
+                address++; // Neither empty nor a directive, so this line holds an instruction.
+            }
+        }
+    }
+
+    /**
+     * Read symbols from a file consisting of lines with address and name.
+     */
+    static void read_symbol_table(std::istream &input) {
+        std::string line;
+        while (std::getline(input, line)) {
+            std::istringstream fields(line);
+            int32_t address;
+            std::string name;
+            if (fields >> address >> name) {
+                symbols.emplace(address, name);
+            }
+        }
+    }
+
+    /**
+     * Returns the name of the function starting at the given address.
+     */
+    static std::string function_name(int32_t entry) {
+        auto symbol = symbols.find(entry);
+        if (symbol != symbols.end()) {
+            return symbol->second;
+        }
+        return "fn@" + std::to_string(entry);
+    }
+
+
+    void initialize_profiler(const profiler_config &config) {
+        configuration = config;
+        for (opcode_t opcode = 0; opcode < opcode_count(); opcode++) {
+            if (strcmp(info_for_opcode(opcode).name, "call") == 0) call_opcode = opcode;
+            if (strcmp(info_for_opcode(opcode).name, "ret") == 0) ret_opcode = opcode;
+        }
+
+        if (config.symbols_file != nullptr) {
+            std::ifstream input(config.symbols_file);
+            if (!input) {
+                throw std::invalid_argument(std::string("Unable to open symbols file ").append(config.symbols_file));
+            }
+            if (has_extension(config.symbols_file, ".asm")) {
+                read_assembler_symbols(input);
+            } else {
+                read_symbol_table(input);
+            }
+        }
+    }
+
+    [[nodiscard]] bool profiler_enabled() {
+        return configuration.opcodes || configuration.call_graph_file != nullptr;
+    }
+
+
+    /**
+     * Enter the function starting at the given address.
+     */
+    static void enter_function(int32_t entry, uint64_t now) {
+        size_t node;
+        if (call_stack.empty()) {
+            node = call_tree.size();
+            call_tree.push_back({.entry = entry, .parent = node});
+        } else {
+            const size_t parent = call_stack.back().node;
+            auto child = call_tree[parent].children.find(entry);
+            if (child != call_tree[parent].children.end()) {
+                node = child->second;
+            } else {
+                node = call_tree.size();
+                call_tree[parent].children.emplace(entry, node);
+                call_tree.push_back({.entry = entry, .parent = parent});
+            }
+        }
+
+        function_entry &function = function_profile[entry];
+        function.calls++;
+        function.active++;
+        call_stack.push_back({.node = node, .start = now, .child_cycles = 0});
+    }
+
+    /**
+     * Leave the innermost function, attributing the cycles spent in it.
+     */
+    static void leave_function(uint64_t now) {
+        const call_frame frame = call_stack.back();
+        call_stack.pop_back();
+
+        const uint64_t inclusive = now - frame.start;
+        const uint64_t exclusive = inclusive - frame.child_cycles;
+        call_node &node = call_tree[frame.node];
+        node.exclusive_cycles += exclusive;
+
+        function_entry &function = function_profile[node.entry];
+        function.exclusive_cycles += exclusive;
+        if (--function.active == 0) {
+            function.inclusive_cycles += inclusive;
+        }
+        if (!call_stack.empty()) {
+            call_stack.back().child_cycles += inclusive;
+        }
+    }
+
+    void run_profiled(VM &vm) {
+        opcode_profile = std::vector<profile_entry>(opcode_count());
+        location_profile = std::vector<profile_entry>(vm.program.size());
+        vm.suspended = false;
+        vm.segment_start = vm.pc;
+        const bool track_calls = configuration.call_graph_file != nullptr;
+        if (track_calls) {
+            enter_function(vm.pc, read_cycles()); // Outermost frame starts at the entry point.
+        }
+
+        run_guarded(vm.stack, [&]() {
+            bool running;
+            do {
+                const int32_t location = vm.pc;
+                const instruction_t instruction = vm.program.at(vm.pc); // Fetch instruction.
+                vm.pc++;                                                // Increment pc.
+
+                const uint64_t start = read_cycles();
+                running = exec_instruction(vm, instruction);            // Execute instruction.
+                const uint64_t end = read_cycles();
+
+                if (configuration.opcodes) {
+                    const uint64_t elapsed = end - start;
+                    profile_entry &by_opcode = opcode_profile.at(get_opcode(instruction));
+                    by_opcode.executions++;
+                    by_opcode.cycles += elapsed;
+                    profile_entry &by_location = location_profile[location];
+                    by_location.executions++;
+                    by_location.cycles += elapsed;
+                }
+                if (track_calls) {
+                    if (get_opcode(instruction) == call_opcode) {
+                        enter_function(vm.pc, end);
+                    } else if (get_opcode(instruction) == ret_opcode && call_stack.size() > 1) {
+                        leave_function(end); // Unbalanced returns keep the outermost frame.
+                    }
+                }
+            } while (running);
+        });
+
+        if (track_calls) {
+            // Unwind all functions still executing when the program halted.
+            const uint64_t end = read_cycles();
+            while (!call_stack.empty()) {
+                leave_function(end);
+            }
+        }
+    }
+
+
+    /**
+     * Returns the indices of all executed entries, sorted descending by the
+     * cycles spent executing them.
+     */
+    static std::vector<size_t> sorted_by_cycles(const std::vector<profile_entry> &entries) {
+        std::vector<size_t> indices;
+        for (size_t index = 0; index < entries.size(); index++) {
+            if (entries[index].executions > 0) {
+                indices.push_back(index);
+            }
+        }
+        std::ranges::stable_sort(indices, [&entries](size_t a, size_t b) {
+            return entries[a].cycles > entries[b].cycles;
+        });
+        return indices;
+    }
+
+    /**
+     * Prints a single row of the profile report.
+     */
+    static void print_row(std::ostream &out, const profile_entry &entry, uint64_t total_cycles) {
+        const double share = total_cycles == 0 ? 0 : 100.0 * static_cast<double>(entry.cycles) / total_cycles;
+        out << std::setw(14) << entry.executions
+            << std::setw(16) << entry.cycles
+            << std::setw(10) << std::fixed << std::setprecision(1)
+            << static_cast<double>(entry.cycles) / static_cast<double>(entry.executions)
+            << std::setw(8) << share << "%  ";
+    }
+
+    /**
+     * Prints the table of opcodes, instruction classes and hottest locations.
+     */
+    static void print_opcode_profile(const VM &vm, std::ostream &out) {
+        const uint64_t total_cycles = std::accumulate(
+                opcode_profile.begin(), opcode_profile.end(), uint64_t{0},
+                [](uint64_t sum, const profile_entry &entry) { return sum + entry.cycles; });
+        const uint64_t total_executions = std::accumulate(
+                opcode_profile.begin(), opcode_profile.end(), uint64_t{0},
+                [](uint64_t sum, const profile_entry &entry) { return sum + entry.executions; });
+
+        out << "Profile: " << total_executions << " instructions executed in "
+            << total_cycles << " cycles." << std::endl;
+
+        // Aggregate opcodes by their instruction class.
+        std::vector<profile_entry> class_profile(INSTRUCTION_CLASS_COUNT);
+        for (size_t opcode = 0; opcode < opcode_profile.size(); opcode++) {
+            profile_entry &entry = class_profile[static_cast<size_t>(info_for_opcode(opcode).kind)];
+            entry.executions += opcode_profile[opcode].executions;
+            entry.cycles += opcode_profile[opcode].cycles;
+        }
+
+        out << std::endl << std::left << std::setw(12) << "class" << std::right
+            << std::setw(14) << "executions" << std::setw(16) << "cycles"
+            << std::setw(10) << "cyc/exec" << std::setw(9) << "share" << std::endl;
+        for (size_t kind: sorted_by_cycles(class_profile)) {
+            out << std::left << std::setw(12) << class_name(static_cast<instruction_class>(kind)) << std::right;
+            print_row(out, class_profile[kind], total_cycles);
+            out << std::endl;
+        }
+
+        out << std::endl << std::left << std::setw(12) << "opcode" << std::right
+            << std::setw(14) << "executions" << std::setw(16) << "cycles"
+            << std::setw(10) << "cyc/exec" << std::setw(9) << "share" << std::endl;
+        for (size_t opcode: sorted_by_cycles(opcode_profile)) {
+            out << std::left << std::setw(12) << info_for_opcode(opcode).name << std::right;
+            print_row(out, opcode_profile[opcode], total_cycles);
+            out << std::endl;
+        }
+
+        out << std::endl << std::left << std::setw(12) << "pc" << std::right
+            << std::setw(14) << "executions" << std::setw(16) << "cycles"
+            << std::setw(10) << "cyc/exec" << std::setw(9) << "share" << "  instruction" << std::endl;
+        std::vector<size_t> hottest = sorted_by_cycles(location_profile);
+        if (hottest.size() > PROFILE_HOTTEST_LOCATIONS) {
+            hottest.resize(PROFILE_HOTTEST_LOCATIONS);
+        }
+        for (size_t location: hottest) {
+            out << std::left << std::setw(12) << location << std::right;
+            print_row(out, location_profile[location], total_cycles);
+            print_instruction(vm.program[location], out);
+        }
+        out << std::defaultfloat;
+    }
+
+
+    /**
+     * Returns the collapsed call stack leading to the given node.
+     */
+    static std::string collapsed_stack(size_t node) {
+        std::string stack = function_name(call_tree[node].entry);
+        while (call_tree[node].parent != node) {
+            node = call_tree[node].parent;
+            stack.insert(0, function_name(call_tree[node].entry) + ";");
+        }
+        return stack;
+    }
+
+    /**
+     * Prints the table of functions and writes collapsed call stacks.
+     */
+    static void print_call_profile(std::ostream &out) {
+        std::vector<int32_t> entries;
+        for (const auto &[entry, function]: function_profile) {
+            entries.push_back(entry);
+        }
+        std::ranges::stable_sort(entries, [](int32_t a, int32_t b) {
+            return function_profile[a].exclusive_cycles > function_profile[b].exclusive_cycles;
+        });
+
+        out << std::endl << std::left << std::setw(24) << "function" << std::right
+            << std::setw(12) << "calls" << std::setw(16) << "inclusive" << std::setw(16) << "exclusive" << std::endl;
+        for (int32_t entry: entries) {
+            const function_entry &function = function_profile[entry];
+            out << std::left << std::setw(24) << function_name(entry) << std::right
+                << std::setw(12) << function.calls
+                << std::setw(16) << function.inclusive_cycles
+                << std::setw(16) << function.exclusive_cycles << std::endl;
+        }
+
+        std::ofstream collapsed(configuration.call_graph_file);
+        if (!collapsed) {
+            throw std::runtime_error(
+                    std::string("Unable to create call graph file ").append(configuration.call_graph_file));
+        }
+        for (size_t node = 0; node < call_tree.size(); node++) {
+            if (call_tree[node].exclusive_cycles > 0) {
+                collapsed << collapsed_stack(node) << " " << call_tree[node].exclusive_cycles << "\n";
+            }
+        }
+    }
+
+    void print_profile(const VM &vm, std::ostream &out) {
+        if (configuration.opcodes) {
+            print_opcode_profile(vm, out);
+        }
+        if (configuration.call_graph_file != nullptr) {
+            print_call_profile(out);
+        }
+    }
+}
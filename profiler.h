@@ -0,0 +1,80 @@
+
+#pragma once
+
+/**
+ * Execution profiler of the NJVM.
+ *
+ * When enabled, the machine counts how often every opcode and every
+ * instruction of the program is executed and measures the cycles spent
+ * executing them. Additionally, calls can be tracked to attribute cycles
+ * to the functions of a program. A report is printed once execution has
+ * finished. Profiles are collected separately for every thread.
+ */
+
+#include <cstdint>
+#include <iostream>
+
+namespace NJVM {
+
+    struct VM;
+
+    /**
+     * Amount of hottest program locations listed in a profile report.
+     */
+    constexpr size_t PROFILE_HOTTEST_LOCATIONS = 10;
+
+    /**
+     * Profiler configuration.
+     */
+    struct profiler_config {
+        /**
+         * Collect executions and cycles per opcode and program location.
+         */
+        bool opcodes;
+        /**
+         * Path of the file receiving collapsed call stacks, or nullptr if
+         * calls are not tracked.
+         */
+        const char *call_graph_file;
+        /**
+         * Path of a file naming functions, or nullptr if functions are
+         * named after their entry address.
+         */
+        const char *symbols_file;
+    };
+
+    /**
+     * Reads a timestamp counting processor cycles. On machines without a
+     * timestamp counter, nanoseconds are counted instead.
+     */
+    [[nodiscard]] uint64_t read_cycles();
+
+    /**
+     * Prepare the profiler for the loaded program.
+     *
+     * A symbols file either consists of lines holding an entry address and
+     * a function name separated by whitespace, or is the assembler source of
+     * the program, in which case labels are used as function names.
+     */
+    void initialize_profiler(const profiler_config &config);
+
+    /**
+     * Returns true, if the profiler was configured to collect any data.
+     */
+    [[nodiscard]] bool profiler_enabled();
+
+    /**
+     * Run the program loaded into a machine until it halts or reaches its
+     * instruction limit, collecting a profile for every instruction executed.
+     */
+    void run_profiled(VM &vm);
+
+    /**
+     * Prints the collected profile to the given stream. Opcodes, program
+     * locations and functions are sorted by the cycles spent executing them.
+     * Collapsed call stacks are written to the configured file, where they
+     * can be processed by flamegraph.pl.
+     */
+    void print_profile(const VM &vm, std::ostream &out);
+
+}
@@ -0,0 +1,255 @@
+
+#include <cstdint>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "njvm.h"
+#include "gc.h"
+#include "snapshot.h"
+
+namespace NJVM {
+
+    /**
+     * Snapshot file header contains a magic number, the machine version
+     * and object layout that created the snapshot, the sizes of all stored
+     * sections and the registers of the machine.
+     *
+     * References are stored as raw addresses. The address of the heap half
+     * they were pointing into is stored as well, so they can be relocated
+     * when the snapshot is restored.
+     */
+    struct NJVM_snapshot_header {
+        char magic[NJSS_MAGIC_SIZE];
+        uint32_t version;
+        uint32_t object_layout;
+        uint32_t instruction_count;
+        uint32_t static_vars_count;
+        int32_t pc, sp, fp;
+        uint64_t ret;
+        uint64_t heap_base;
+        uint64_t heap_size;
+    };
+
+    /**
+     * Version of the object layout stored in the heap section. Incremented
+     * whenever the layout of ninja_object changes.
+     */
+    constexpr uint32_t OBJECT_LAYOUT = 3;
+
+    /**
+     * Representation of a single stack slot within a snapshot file.
+     */
+    struct NJVM_snapshot_slot {
+        uint32_t is_reference;
+        uint32_t internal;
+        uint64_t reference;
+    };
+
+
+    /**
+     * Write the given amount of elements to the output file, failing if not
+     * all of them could be written.
+     */
+    static void write_section(FILE *output, const void *data, size_t element_size, size_t count) {
+        if (fwrite(data, element_size, count, output) != count) {
+            throw std::runtime_error("Failed to write snapshot file.");
+        }
+    }
+
+    void write_snapshot(VM &vm, const char *filename) {
+        if (!vm.waiting_threads.empty()) {
+            throw std::logic_error("Snapshots of machines running multiple threads are not supported.");
+        }
+        FILE *output = fopen(filename, "wb");
+        if (output == nullptr) {
+            std::stringstream ss;
+            ss << "Unable to create file " << filename << ": " << std::strerror(errno);
+            throw std::invalid_argument(ss.str());
+        }
+
+        NJVM_snapshot_header header{};
+        std::memcpy(header.magic, NJSS_MAGIC, NJSS_MAGIC_SIZE);
+        header.version = NJVM::version;
+        header.object_layout = OBJECT_LAYOUT;
+        header.instruction_count = vm.program.size();
+        header.static_vars_count = vm.static_data.size();
+        header.pc = vm.pc;
+        header.sp = vm.sp;
+        header.fp = vm.fp;
+        header.ret = reinterpret_cast<uint64_t>(vm.ret);
+        header.heap_base = reinterpret_cast<uint64_t>(vm.heap.active_half);
+        header.heap_size = vm.heap.bytes_used;
+
+        try {
+            write_section(output, &header, sizeof(header), 1);
+            write_section(output, vm.program.data(), sizeof(instruction_t), vm.program.size());
+            write_section(output, vm.static_data.data(), sizeof(ObjRef), vm.static_data.size());
+            for (int32_t offset = 0; offset < vm.sp; offset++) {
+                NJVM_snapshot_slot slot{};
+                slot.is_reference = vm.stack[offset].isObjRef;
+                if (vm.stack[offset].isObjRef) {
+                    slot.reference = reinterpret_cast<uint64_t>(vm.stack[offset].u.reference);
+                } else {
+                    slot.internal = vm.stack[offset].u.internal;
+                }
+                write_section(output, &slot, sizeof(slot), 1);
+            }
+            write_section(output, vm.heap.active_half, sizeof(unsigned char), vm.heap.bytes_used);
+        } catch (...) {
+            fclose(output);
+            throw;
+        }
+        if (fclose(output) != 0) {
+            throw std::runtime_error("Failed to write snapshot file.");
+        }
+    }
+
+
+    /**
+     * Cursor reading sections from a memory mapped snapshot file.
+     */
+    struct snapshot_reader {
+        const unsigned char *position, *end;
+
+        const unsigned char *read(size_t element_size, size_t count) {
+            const size_t size = element_size * count;
+            if (size > static_cast<size_t>(end - position)) {
+                throw std::invalid_argument("Snapshot file is truncated.");
+            }
+            const unsigned char *section = position;
+            position += size;
+            return section;
+        }
+    };
+
+    /**
+     * Relocate a reference stored in the snapshot to the current heap.
+     */
+    static ObjRef relocate(VM &vm, uint64_t reference, const NJVM_snapshot_header &header) {
+        if (reference == 0) {
+            return nil;
+        }
+        if (reference < header.heap_base || reference - header.heap_base >= header.heap_size) {
+            throw std::invalid_argument("Snapshot contains reference outside of heap.");
+        }
+        return reinterpret_cast<ObjRef>(vm.heap.active_half + (reference - header.heap_base));
+    }
+
+    /**
+     * Restore the machine state from a mapped snapshot file.
+     */
+    static void restore(VM &vm, snapshot_reader &reader) {
+        NJVM_snapshot_header header;
+        std::memcpy(&header, reader.read(sizeof(header), 1), sizeof(header));
+
+        if (strncmp(header.magic, NJSS_MAGIC, NJSS_MAGIC_SIZE) != 0) {
+            throw std::invalid_argument("Invalid header in snapshot file.");
+        }
+        if (header.version != NJVM::version) {
+            throw std::invalid_argument("Snapshot was created by a different machine version.");
+        }
+        if (header.object_layout != OBJECT_LAYOUT) {
+            throw std::invalid_argument("Snapshot was created with a different object layout.");
+        }
+
+        const auto *instructions = reinterpret_cast<const instruction_t *>(
+                reader.read(sizeof(instruction_t), header.instruction_count));
+        if (vm.program.empty()) {
+            vm.program.assign(instructions, instructions + header.instruction_count);
+        } else if (vm.program.size() != header.instruction_count ||
+                   std::memcmp(vm.program.data(), instructions, vm.program.size() * sizeof(instruction_t)) != 0) {
+            throw std::invalid_argument("Snapshot was created for a different program.");
+        }
+
+        if (header.sp < 0 || header.fp < 0 || header.fp > header.sp || static_cast<size_t>(header.sp) > vm.stack.size()) {
+            std::stringstream ss;
+            ss << "Stack of snapshot with " << header.sp << " slots does not fit into stack of "
+               << vm.stack.size() << " slots.";
+            throw std::invalid_argument(ss.str());
+        }
+
+        const unsigned char *static_section = reader.read(sizeof(uint64_t), header.static_vars_count);
+        const unsigned char *stack_section = reader.read(sizeof(NJVM_snapshot_slot), header.sp);
+        restore_heap(vm, reader.read(sizeof(unsigned char), header.heap_size), header.heap_size);
+
+        // Relocate references between objects stored on the heap.
+        for (size_t offset = 0; offset < header.heap_size;) {
+            ObjRef object = reinterpret_cast<ObjRef>(vm.heap.active_half + offset);
+            offset += allocation_size(object->get_size(), object->is_compound());
+            if (offset > header.heap_size) {
+                throw std::invalid_argument("Snapshot contains malformed heap.");
+            }
+
+            if (object->is_compound()) {
+                for (size_t i = 0; i < object->get_size(); i++) {
+                    ObjRef &member = get_member(object, i);
+                    member = relocate(vm, reinterpret_cast<uint64_t>(member), header);
+                }
+            }
+        }
+
+        vm.static_data = std::vector<ObjRef>(header.static_vars_count);
+        for (size_t index = 0; index < vm.static_data.size(); index++) {
+            uint64_t reference;
+            std::memcpy(&reference, static_section + index * sizeof(uint64_t), sizeof(uint64_t));
+            vm.static_data[index] = relocate(vm, reference, header);
+        }
+
+        for (int32_t offset = 0; offset < header.sp; offset++) {
+            NJVM_snapshot_slot slot;
+            std::memcpy(&slot, stack_section + offset * sizeof(NJVM_snapshot_slot), sizeof(slot));
+            if (slot.is_reference) {
+                vm.stack.at(offset) = relocate(vm, slot.reference, header);
+            } else {
+                vm.stack.at(offset) = static_cast<int32_t>(slot.internal);
+            }
+        }
+
+        vm.pc = header.pc;
+        vm.sp = header.sp;
+        vm.fp = header.fp;
+        vm.ret = relocate(vm, header.ret, header);
+    }
+
+    void load_snapshot(VM &vm, const char *filename) {
+        int descriptor = open(filename, O_RDONLY);
+        if (descriptor < 0) {
+            std::stringstream ss;
+            ss << "Unable to open file " << filename << ": " << std::strerror(errno);
+            throw std::invalid_argument(ss.str());
+        }
+
+        struct stat status{};
+        if (fstat(descriptor, &status) != 0 || status.st_size == 0) {
+            close(descriptor);
+            throw std::invalid_argument("Failed to read header from snapshot file.");
+        }
+
+        const size_t length = status.st_size;
+        void *mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        close(descriptor); // Mapping stays valid after closing the descriptor.
+        if (mapping == MAP_FAILED) {
+            std::stringstream ss;
+            ss << "Unable to map file " << filename << ": " << std::strerror(errno);
+            throw std::runtime_error(ss.str());
+        }
+
+        snapshot_reader reader{static_cast<const unsigned char *>(mapping),
+                               static_cast<const unsigned char *>(mapping) + length};
+        try {
+            restore(vm, reader);
+        } catch (...) {
+            munmap(mapping, length);
+            throw;
+        }
+        munmap(mapping, length);
+    }
+}
@@ -0,0 +1,49 @@
+
+#pragma once
+
+/**
+ * Heap snapshots of the NJVM, allowing to save a warmed-up machine and
+ * resume execution later on.
+ */
+
+#include <cstddef>
+
+namespace NJVM {
+
+    struct VM;
+
+    /**
+     * Amount of bytes in a snapshot file's magic.
+     */
+    constexpr size_t NJSS_MAGIC_SIZE = 4;
+
+    /**
+     * Bytes of a snapshot file's magic.
+     */
+    constexpr char NJSS_MAGIC[NJSS_MAGIC_SIZE] = {'N', 'J', 'S', 'S'};
+
+    /**
+     * Write a snapshot of the state of a machine to the given file.
+     *
+     * The snapshot contains the program, static data, stack, registers and
+     * the active heap half. A garbage collection should be performed before,
+     * so only live objects are stored. Machines running multiple Ninja
+     * threads cannot be stored.
+     *
+     * @param filename C-style string of the path to the created snapshot file.
+     */
+    void write_snapshot(VM &vm, const char *filename);
+
+    /**
+     * Restore the state of a machine from a snapshot file, so execution resumes
+     * with the instruction following the checkpoint.
+     *
+     * Stack and heap must be initialized before and large enough to hold the
+     * stored contents. All references are relocated to the current heap. If a
+     * program was already loaded, it must match the program of the snapshot.
+     *
+     * @param filename C-style string of the path to the snapshot file.
+     */
+    void load_snapshot(VM &vm, const char *filename);
+
+}
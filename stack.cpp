@@ -0,0 +1,170 @@
+
+#include <stdexcept>
+#include <sstream>
+#include <algorithm>
+#include <new>
+#include <mutex>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "stack.h"
+
+namespace NJVM {
+
+    /**
+     * Round the given amount of bytes up to whole pages.
+     */
+    static size_t page_align(size_t bytes) {
+        static const size_t page_size = sysconf(_SC_PAGESIZE);
+        return (bytes + page_size - 1) / page_size * page_size;
+    }
+
+    thread_local stack_guard_state stack_guard;
+
+    ninja_stack::ninja_stack(size_t initial_slots, size_t maximum_slots) : maximum(maximum_slots) {
+        if (maximum_slots == 0 || initial_slots > maximum_slots) {
+            throw std::invalid_argument("Initial stack size must not exceed the maximum stack size.");
+        }
+
+        // Reserve address space only. Pages are zeroed when first touched, which is an empty slot.
+        reserved_bytes = page_align(maximum_slots * sizeof(stack_slot));
+        guard_bytes = page_align(static_cast<size_t>(GUARD_SLOTS) * sizeof(stack_slot));
+        void *reservation = mmap(nullptr, guard_bytes + reserved_bytes + guard_bytes, PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (reservation == MAP_FAILED) {
+            throw std::bad_alloc();
+        }
+        slots = reinterpret_cast<stack_slot *>(static_cast<char *>(reservation) + guard_bytes);
+        if (initial_slots > 0) {
+            grow(initial_slots - 1);
+        }
+    }
+
+    ninja_stack::~ninja_stack() {
+        if (slots != nullptr) {
+            munmap(reinterpret_cast<char *>(slots) - guard_bytes, guard_bytes + reserved_bytes + guard_bytes);
+        }
+    }
+
+    ninja_stack::ninja_stack(ninja_stack &&other) noexcept
+            : slots(other.slots), committed(other.committed), maximum(other.maximum),
+              reserved_bytes(other.reserved_bytes), guard_bytes(other.guard_bytes) {
+        other.slots = nullptr;
+        other.committed = other.maximum = other.reserved_bytes = other.guard_bytes = 0;
+    }
+
+    ninja_stack &ninja_stack::operator=(ninja_stack &&other) noexcept {
+        std::swap(slots, other.slots);
+        std::swap(committed, other.committed);
+        std::swap(maximum, other.maximum);
+        std::swap(reserved_bytes, other.reserved_bytes);
+        std::swap(guard_bytes, other.guard_bytes);
+        return *this;
+    }
+
+    void ninja_stack::grow(size_t index) {
+        if (static_cast<ptrdiff_t>(index) < 0) {
+            throw std::underflow_error("Stack underflow.");
+        }
+        if (index >= maximum) {
+            std::stringstream ss;
+            ss << "Stack overflow, the maximum stack size of " << maximum << " slots is exceeded.";
+            throw std::overflow_error(ss.str());
+        }
+
+        if (!commit(index)) {
+            throw std::bad_alloc();
+        }
+    }
+
+    bool ninja_stack::commit(size_t index) noexcept {
+        const size_t slot_count = std::min(maximum, std::max(index + 1, 2 * committed));
+        const size_t bytes = std::min(reserved_bytes, page_align(slot_count * sizeof(stack_slot)));
+        if (mprotect(slots, bytes, PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        committed = std::min(maximum, bytes / sizeof(stack_slot));
+        return true;
+    }
+
+    ninja_stack::fault ninja_stack::handle_fault(const void *address) noexcept {
+        const auto faulting = reinterpret_cast<uintptr_t>(address);
+        const auto begin = reinterpret_cast<uintptr_t>(slots);
+        if (slots == nullptr || faulting < begin - guard_bytes || faulting >= begin + reserved_bytes + guard_bytes) {
+            return fault::none;
+        }
+        if (faulting < begin) {
+            return fault::underflow;
+        }
+
+        const size_t index = (faulting - begin) / sizeof(stack_slot);
+        if (index >= maximum || !commit(index)) {
+            return fault::overflow;
+        }
+        return fault::grown;
+    }
+
+
+    static struct sigaction previous_action;
+
+    /**
+     * Grow the stack of the interpreter or throw the exception of a stack
+     * fault, if the fault is caused by a stack access of the interpreter.
+     */
+    static void handle_segmentation_fault(int signal, siginfo_t *info, void *context) {
+        stack_guard_state &state = stack_guard;
+        if (state.stack != nullptr) {
+            const ninja_stack::fault fault = state.stack->handle_fault(info->si_addr);
+            if (fault == ninja_stack::fault::grown) {
+                return; // Retry the access.
+            }
+            if (fault != ninja_stack::fault::none) {
+                // The handler is left with an exception instead of returning, which would unblock the signal.
+                sigset_t faults;
+                sigemptyset(&faults);
+                sigaddset(&faults, SIGSEGV);
+                pthread_sigmask(SIG_UNBLOCK, &faults, nullptr);
+                throw_stack_fault(*state.stack, fault);
+            }
+        }
+
+        // Any other fault is passed on to the previous handler, which stays installed behind this one.
+        if (previous_action.sa_flags & SA_SIGINFO) {
+            previous_action.sa_sigaction(signal, info, context);
+        } else if (previous_action.sa_handler != SIG_DFL && previous_action.sa_handler != SIG_IGN) {
+            previous_action.sa_handler(signal);
+        } else {
+            // The default disposition terminates the process, once the signal is unblocked on return.
+            struct sigaction default_action{};
+            default_action.sa_handler = SIG_DFL;
+            sigemptyset(&default_action.sa_mask);
+            sigaction(SIGSEGV, &default_action, nullptr);
+            raise(SIGSEGV);
+        }
+    }
+
+    void install_stack_fault_handler() {
+        static std::once_flag installed;
+        std::call_once(installed, []() {
+            struct sigaction action{};
+            action.sa_sigaction = handle_segmentation_fault;
+            action.sa_flags = SA_SIGINFO;
+            sigemptyset(&action.sa_mask);
+            if (sigaction(SIGSEGV, &action, &previous_action) != 0) {
+                throw std::runtime_error("Unable to install stack fault handler.");
+            }
+        });
+    }
+
+    void throw_stack_fault(const ninja_stack &stack, ninja_stack::fault fault) {
+        if (fault == ninja_stack::fault::underflow) {
+            throw std::underflow_error("Stack underflow.");
+        }
+        std::stringstream ss;
+        ss << "Stack overflow, the maximum stack size of " << stack.size() << " slots is exceeded.";
+        throw std::overflow_error(ss.str());
+    }
+}
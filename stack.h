@@ -0,0 +1,159 @@
+
+#pragma once
+
+/**
+ * Growable stack of the NJVM.
+ *
+ * The address space for the maximum stack size is reserved once, but only
+ * a small part of it is made accessible initially. The reservation is
+ * surrounded by inaccessible guard regions covering every slot an
+ * instruction can address relative to a valid stack or frame pointer.
+ * The interpreter accesses slots without any checks inside of run_guarded:
+ * accesses beyond the accessible part grow the stack from the SIGSEGV
+ * handler, accesses to a guard region throw an exception from the faulting
+ * access. Code accessing slots unchecked is therefore compiled with
+ * -fnon-call-exceptions (see CMakeLists.txt), so catch blocks and
+ * destructors of the interpreter run as for any other exception.
+ * Slots never move, so references to them stay valid.
+ */
+
+#include <cstddef>
+
+#include "types.h"
+
+namespace NJVM {
+
+    /**
+     * Slots covered by the guard region on either side of a stack. pushl and
+     * popl check locals further away from the frame pointer explicitly, as
+     * accessing them could skip over the guard region.
+     */
+    constexpr ptrdiff_t GUARD_SLOTS = 2048;
+
+    class ninja_stack {
+    public:
+        ninja_stack() = default;
+
+        /**
+         * Reserve a stack of maximum_slots slots, of which initial_slots are
+         * accessible right away. All slots hold the primitive value 0 initially.
+         */
+        ninja_stack(size_t initial_slots, size_t maximum_slots);
+
+        ~ninja_stack();
+
+        ninja_stack(ninja_stack &&other) noexcept;
+        ninja_stack &operator=(ninja_stack &&other) noexcept;
+        ninja_stack(const ninja_stack &) = delete;
+        ninja_stack &operator=(const ninja_stack &) = delete;
+
+        /**
+         * Access a slot without checking whether it is accessible. Only valid
+         * for committed slots, or inside of run_guarded for this stack.
+         */
+        stack_slot &operator[](ptrdiff_t index) {
+            return slots[index];
+        }
+
+        /**
+         * First slot of the stack, for unchecked accesses like operator[].
+         */
+        stack_slot *data() {
+            return slots;
+        }
+
+        /**
+         * Access a slot, growing the stack if necessary. Fails if the slot is
+         * outside of the maximum stack size.
+         */
+        stack_slot &at(size_t index) {
+            if (index >= committed) [[unlikely]] {
+                grow(index);
+            }
+            return slots[index];
+        }
+
+        /**
+         * Maximum amount of slots this stack may grow to.
+         */
+        [[nodiscard]] size_t size() const {
+            return maximum;
+        }
+
+        /**
+         * Amount of slots currently accessible without growing the stack.
+         */
+        [[nodiscard]] size_t committed_size() const {
+            return committed;
+        }
+
+        /**
+         * Kind of a memory access fault relative to this stack.
+         */
+        enum class fault {
+            none, grown, overflow, underflow
+        };
+
+        /**
+         * Handle a faulting access to the given address. Grows the stack if
+         * the address is inside of the reservation, otherwise reports which
+         * guard region was hit. Async-signal-safe.
+         */
+        fault handle_fault(const void *address) noexcept;
+
+    private:
+        stack_slot *slots = nullptr;
+        size_t committed = 0, maximum = 0;
+        size_t reserved_bytes = 0, guard_bytes = 0;
+
+        /**
+         * Make the slot with the given index accessible, at least doubling
+         * the accessible part of the stack.
+         */
+        void grow(size_t index);
+
+        /**
+         * Like grow, but reports failure instead of throwing.
+         */
+        bool commit(size_t index) noexcept;
+    };
+
+    /**
+     * Stack used by the interpreter on the calling thread.
+     */
+    struct stack_guard_state {
+        ninja_stack *stack = nullptr;
+    };
+
+    extern thread_local stack_guard_state stack_guard;
+
+    /**
+     * Install the SIGSEGV handler translating stack faults, once per process.
+     */
+    void install_stack_fault_handler();
+
+    /**
+     * Throw the exception of a stack overflow or underflow.
+     */
+    [[noreturn]] void throw_stack_fault(const ninja_stack &stack, ninja_stack::fault fault);
+
+    /**
+     * Execute body, which may access the given stack unchecked. Hitting a
+     * guard region of the stack throws std::overflow_error or
+     * std::underflow_error from the faulting access.
+     */
+    template<typename Body>
+    void run_guarded(ninja_stack &stack, Body &&body) {
+        install_stack_fault_handler();
+        const stack_guard_state previous = stack_guard;
+        stack_guard = {&stack};
+        try {
+            body();
+        } catch (...) {
+            stack_guard = previous;
+            throw;
+        }
+        stack_guard = previous;
+    }
+
+}
@@ -4,14 +4,14 @@
  */
 
 #include <stdexcept>
-#include "types.h"
+#include "njvm.h"
 
 void fatalError(char *msg) {
     throw std::logic_error(msg);
 }
 
 void *newPrimObject(int dataSize) {
-    return NJVM::allocateIntegerObject(dataSize);
+    return NJVM::allocateIntegerObject(NJVM::VM::current(), dataSize);
 }
 
 void *getPrimObjectDataPointer(void *primObject) {
@@ -0,0 +1,33 @@
+//
+// version
+//
+	.vers	8
+
+//
+// A local beyond the reach of the stack guard regions is copied between
+// updates of a unique integer, which must not be changed in place with --ir.
+//
+	asf	3000
+	pushc	7
+	pushc	0
+	add
+	popl	0
+	pushl	0
+	pushc	1
+	add
+	popl	0
+	pushl	0
+	popl	2999
+	pushl	0
+	pushc	1
+	add
+	popl	0
+	pushl	0
+	wrint
+	pushc	'\n'
+	wrchr
+	pushl	2999
+	wrint
+	pushc	'\n'
+	wrchr
+	halt
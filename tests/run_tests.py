@@ -1,16 +1,31 @@
 #! /usr/bin/env python3
 
-from os import path, listdir
+from os import path, listdir, makedirs, replace, cpu_count
+from concurrent.futures import ThreadPoolExecutor
+import argparse
+import hashlib
 import sys
 import json
 import subprocess
+import time
+
+parser = argparse.ArgumentParser(description='Compare the output of ./njvm against the reference machine.')
+parser.add_argument('--jobs', type=int, default=cpu_count() or 1,
+                    help='amount of test cases run concurrently, use 1 for comparable timings')
+parser.add_argument('--no-cache', action='store_true', help='always rerun the reference machine')
+parser.add_argument('--timings', help='write njvm wall time per test case to this JSON file')
+parser.add_argument('--baseline', help='compare wall times against timings written by a previous run')
+parser.add_argument('--threshold', type=float, default=1.5, help='slowdown reported as regression (default: 1.5)')
+parser.add_argument('--flags', default='', help='additional flags passed to ./njvm, e.g. --flags=--ir')
+arguments = parser.parse_args()
+
+MINIMUM_REGRESSION = 0.01 # Seconds.
 
-cases_total = 0
-cases_success = 0
 directory = path.dirname(path.abspath(__file__))
+cache_directory = path.join(directory, '.refcache')
 print('Running in directory: ' + directory)
 
-test_dirs = [file for file in listdir(directory) if path.isdir(path.join(directory, file))]
+test_dirs = [file for file in listdir(directory) if path.isdir(path.join(directory, file)) and not file.startswith('.')]
 test_dirs.sort()
 print('Detected ' + str(len(test_dirs)) + ' test configurations.')
 
@@ -30,43 +45,114 @@ def prepare_binary(test_dir, data):
     exec([path.join(directory, 'nja'), path.join(context, name + '.asm'), path.join(context, name + '.bin')])
     return path.join(context, name + '.bin')
 
+def digest(*files, text=''):
+    hash = hashlib.sha256()
+    for file in files:
+        with open(file, 'rb') as content:
+            hash.update(content.read())
+    hash.update(text.encode('utf-8'))
+    return hash.hexdigest()
+
+def reference_output(file, input_text):
+    # Outputs are cached by the contents of reference machine, binary and input.
+    cache_file = path.join(cache_directory, digest(path.join(directory, 'refnjvm'), file, text=input_text))
+    if not arguments.no_cache and path.exists(cache_file):
+        with open(cache_file, 'rb') as cached:
+            return cached.read()
+
+    refprocess = subprocess.Popen([path.join(directory, 'refnjvm'), file], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    refresult = refprocess.communicate(input=input_text.encode('utf-8'))[0]
+
+    makedirs(cache_directory, exist_ok=True)
+    with open(cache_file + '.tmp', 'wb') as cached:
+        cached.write(refresult)
+    replace(cache_file + '.tmp', cache_file)
+    return refresult
+
 def run_test(file, input_config):
     if not isinstance(input_config, list):
         input_config = [input_config]
     input_config = [str(line) for line in input_config]
     input_text = ' '.join(input_config)
 
-    refprocess = subprocess.Popen([path.join(directory, 'refnjvm'), file], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
-    refresult = refprocess.communicate(input=input_text.encode('utf-8'))[0]
+    refresult = reference_output(file, input_text)
 
-    myprocess = subprocess.Popen(['./njvm', file], stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    start = time.perf_counter()
+    myprocess = subprocess.Popen(['./njvm', file] + arguments.flags.split(), stdin=subprocess.PIPE, stdout=subprocess.PIPE)
     myresult = myprocess.communicate(input=input_text.encode('utf-8'))[0]
+    elapsed = time.perf_counter() - start
 
+    report = []
     if myresult != refresult:
-        print('Expected:')
-        print(str(refresult))
-        print('Actual result:')
-        print(str(myresult))
-        return False
-    return True
-
-
-
-for test in test_dirs:
-    try:
-        print('Preparing test case: ' + test)
-        with open(path.join(directory, test, 'data')) as config_file:
-            data = json.load(config_file)
-            bin_file = prepare_binary(test, data)
-            for input_config in data['input']:
-                print('===================== Test Case ' + str(1 + cases_total) + ' =====================')
-                print('File: ' + bin_file)
-                cases_total += 1
-                if run_test(bin_file, input_config):
-                    cases_success += 1
-    except Exception as e:
-        print("Error: " + str(e))
+        report.append('Expected:')
+        report.append(str(refresult))
+        report.append('Actual result:')
+        report.append(str(myresult))
+    return (myresult == refresult, elapsed, report)
+
+def prepare_test(test):
+    with open(path.join(directory, test, 'data')) as config_file:
+        data = json.load(config_file)
+        return (prepare_binary(test, data), data['input'])
+
+
+
+with ThreadPoolExecutor(max_workers=max(1, arguments.jobs)) as executor:
+    prepared = [(test, executor.submit(prepare_test, test)) for test in test_dirs]
+
+    # Test cases are numbered and reported in order, while they are executed concurrently.
+    cases = []
+    for test, preparation in prepared:
+        try:
+            (bin_file, inputs) = preparation.result()
+            for input_config in inputs:
+                cases.append((test, bin_file, input_config, executor.submit(run_test, bin_file, input_config)))
+        except Exception as e:
+            cases.append((test, None, None, e))
+
+    cases_total = 0
+    cases_success = 0
+    timings = {}
+    for test, bin_file, input_config, result in cases:
+        if isinstance(result, Exception):
+            print('Preparing test case: ' + test)
+            print("Error: " + str(result))
+            cases_total += 1
+            continue
+
         cases_total += 1
+        print('===================== Test Case ' + str(cases_total) + ' =====================')
+        print('File: ' + bin_file)
+        try:
+            (success, elapsed, report) = result.result()
+            for line in report:
+                print(line)
+            timings[test + ' ' + json.dumps(input_config)] = elapsed
+            print('Time: %.1f ms' % (elapsed * 1000))
+            if success:
+                cases_success += 1
+        except Exception as e:
+            print("Error: " + str(e))
+
+if arguments.timings:
+    with open(arguments.timings, 'w') as timings_file:
+        json.dump(timings, timings_file, indent=4, sort_keys=True)
+
+if arguments.baseline:
+    with open(arguments.baseline) as baseline_file:
+        baseline = json.load(baseline_file)
+    # Short cases are dominated by process startup, so small absolute differences are ignored.
+    regressions = [(case, elapsed, baseline[case]) for case, elapsed in timings.items()
+                   if case in baseline and elapsed > baseline[case] * arguments.threshold
+                   and elapsed - baseline[case] > MINIMUM_REGRESSION]
+    print('Compared against baseline: ' + str(len(regressions)) + ' cases slower by more than '
+          + str(arguments.threshold) + 'x.')
+    for case, elapsed, previous in sorted(regressions):
+        print('  REGRESSION %s: %.1f ms (baseline %.1f ms)' % (case, elapsed * 1000, previous * 1000))
+
+print('Total njvm time: %.1f ms, slowest cases:' % (sum(timings.values()) * 1000))
+for case, elapsed in sorted(timings.items(), key=lambda entry: -entry[1])[:5]:
+    print('  %8.1f ms  %s' % (elapsed * 1000, case))
 
 print('Passed ' + str(cases_success) + '/' + str(cases_total) + ' tests!')
 if cases_total > cases_success:
@@ -5,29 +5,50 @@
 
 namespace NJVM {
 
-    // Two most significant bits of the object tag are used to store data.
-    const uint32_t COMPOUND_FLAG = 1 << 31,
-            COPIED_FLAG = 1 << 30;
-
-
     //-----------------------------------------------------------------------
     // Ninja object member functions.
     //-----------------------------------------------------------------------
 
     void ninja_object::mark_copied(size_t forward_reference) {
-        this->tag = COPIED_FLAG | forward_reference;
+        this->size = forward_reference;
+        this->flags |= COPIED_FLAG;
     }
 
     bool ninja_object::is_copied() const {
-        return (this->tag & COPIED_FLAG) != 0;
+        return (this->flags & COPIED_FLAG) != 0;
     }
 
     bool ninja_object::is_compound() const {
-        return (this->tag & COMPOUND_FLAG) != 0;
+        return (this->flags & COMPOUND_FLAG) != 0;
     }
 
-    uint32_t ninja_object::get_size() const {
-        return this->tag & ~(COMPOUND_FLAG | COPIED_FLAG); // Dont include data bits in size.
+    size_t ninja_object::get_size() const {
+        return this->size;
+    }
+
+    bool ninja_object::is_unique() const {
+        return (this->flags & UNIQUE_FLAG) != 0;
+    }
+
+    /**
+     * Replace the flags of an object by a single atomic store of its header,
+     * as the concurrent marker may load the header at the same time (see
+     * gc.h). Only the program writes headers while marking, so no atomic
+     * read-modify-write is needed.
+     */
+    static void store_flags(ninja_object *object, uint8_t set, uint8_t clear) {
+        std::atomic_ref<ninja_object> header(*object);
+        ninja_object updated = header.load(std::memory_order_relaxed);
+        updated.flags = (updated.flags & ~clear) | set;
+        header.store(updated, std::memory_order_relaxed);
+    }
+
+    void ninja_object::mark_unique() {
+        store_flags(this, UNIQUE_FLAG, 0);
+    }
+
+    void ninja_object::clear_unique() {
+        store_flags(this, 0, UNIQUE_FLAG);
     }
 
 
@@ -61,21 +82,5 @@ namespace NJVM {
         return u.internal;
     }
 
-
-    //-----------------------------------------------------------------------
-    // Allocation functions for Ninja objects.
-    //-----------------------------------------------------------------------
-
-    [[nodiscard]] ObjRef allocateIntegerObject(size_t byte_count) {
-        ObjRef result = halloc(object_size(byte_count, false));
-        result->tag = byte_count;
-        return result;
-    }
-
-    [[nodiscard]] ObjRef allocateCompoundObject(size_t member_count) {
-        ObjRef result = halloc(object_size(member_count, true));
-        result->tag = member_count | COMPOUND_FLAG;
-        return result;
-    }
 }
 
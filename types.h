@@ -7,6 +7,7 @@
  */
 
 #include <cstdint>
+#include <atomic>
 #include <stdexcept>
 #include <sstream>
 
@@ -31,19 +32,34 @@ namespace NJVM {
 
     /**
      * Ninja object definition.
+     *
+     * Every object starts with a single 64-bit header word, so the payload is
+     * aligned for object references. Objects are allocated at 8 byte boundaries.
      */
     struct ninja_object {
         /**
-         * Tag encoding size of object including variant (integer, array/record) and
-         * garbage collection data.
+         * Amount of values stored in the data section of this object, or the
+         * offset of its copy if it was copied during garbage collection.
+         */
+        uint64_t size: 40;
+        /**
+         * Variant (integer, array/record) and garbage collection data.
+         */
+        uint64_t flags: 8;
+        /**
+         * Unused, reserved for the amount of collections survived.
+         */
+        uint64_t age: 8;
+        /**
+         * Unused, reserved for an identity hash.
          */
-        uint32_t tag;
+        uint64_t hash: 8;
         /**
          * Array holding raw object data. The actual size of this data is determined
          * at runtime and set to 0 so no extra bytes are allocated for instances of
          * this struct.
          */
-        unsigned char data[0];
+        alignas(8) unsigned char data[0];
 
         /**
          * Returns the amount of values stored in the data section of this object.
@@ -51,7 +67,7 @@ namespace NJVM {
          * This may either represent the amount of raw bytes or the amount of
          * references to other objects.
          */
-        [[nodiscard]] uint32_t get_size() const;
+        [[nodiscard]] size_t get_size() const;
 
         /**
          * Returns true if this objects represents a compound object. Returns false
@@ -73,19 +89,55 @@ namespace NJVM {
          * Returns true, if mark_copied has been called on this object.
          */
         [[nodiscard]] bool is_copied() const;
+
+        /**
+         * Returns true, if this integer is referenced by a single local
+         * variable only, so it may be updated in place (see ir.h).
+         */
+        [[nodiscard]] bool is_unique() const;
+
+        /**
+         * Mark this object as referenced by a single local variable only.
+         */
+        void mark_unique();
+
+        /**
+         * Clear the unique mark, once the reference is copied.
+         */
+        void clear_unique();
     };
 
+    static_assert(sizeof(ninja_object) == 8, "Object header must keep the payload aligned.");
+    static_assert(std::atomic_ref<ninja_object>::is_always_lock_free,
+                  "Object headers are loaded by the concurrent marker while the program updates them.");
+
+    // Bits of the object flags.
+    constexpr uint8_t COMPOUND_FLAG = 1 << 0,
+            COPIED_FLAG = 1 << 1,
+            UNIQUE_FLAG = 1 << 2;
+
+    /**
+     * Alignment of all objects on the heap.
+     */
+    constexpr size_t OBJECT_ALIGNMENT = 8;
+
+    /**
+     * Largest value of the size field of the object header.
+     */
+    constexpr size_t MAXIMUM_HEADER_SIZE = (UINT64_C(1) << 40) - 1;
+
     /**
      * The largest possible size of a single object. There is no guarantee that the
      * NJVM actually allocates an object this large.
      */
-    constexpr size_t MAXIMUM_OBJECT_SIZE = (UINT32_MAX >> 2) - 1;
+    constexpr size_t MAXIMUM_OBJECT_SIZE = MAXIMUM_HEADER_SIZE;
 
     /**
      * The largest possible size of a single heap half. The combined byte size of all
-     * live objects cannot exceed this number.
+     * live objects cannot exceed this number, as the offset of copies is stored in
+     * the size field of the original during garbage collection.
      */
-    constexpr size_t MAXIMUM_HEAP_HALF_SIZE = (UINT32_MAX >> 2) - 1;
+    constexpr size_t MAXIMUM_HEAP_HALF_SIZE = MAXIMUM_HEADER_SIZE;
 
 
     /**
@@ -115,6 +167,14 @@ namespace NJVM {
         return sizeof(ninja_object) + payload_size(member_count, is_compound);
     }
 
+    /**
+     * Compute the amount of bytes a Ninja object occupies on the heap, which is
+     * its object size rounded up to the object alignment.
+     */
+    constexpr size_t allocation_size(size_t member_count, bool is_compound) {
+        return (object_size(member_count, is_compound) + OBJECT_ALIGNMENT - 1) & ~(OBJECT_ALIGNMENT - 1);
+    }
+
 
     /**
      * Single slot in the VM runtime stack.
@@ -163,20 +223,25 @@ namespace NJVM {
     };
 
 
+    struct VM;
+
     /**
-     * Allocate a Ninja integer object allocating the given amount of bytes as payload.
+     * Allocate a Ninja integer object on the heap of the given machine, allocating
+     * the given amount of bytes as payload.
      *
      * This function will not initialize any of the data stored in the object.
+     * It is defined in njvm.h, inlining the allocation fast path.
      */
-    [[nodiscard]] ObjRef allocateIntegerObject(size_t byte_count);
+    [[nodiscard]] inline ObjRef allocateIntegerObject(VM &vm, size_t byte_count);
 
     /**
-     * Allocate a Ninja compound object allocating the given amount of object
-     * references as payload.
+     * Allocate a Ninja compound object on the heap of the given machine, allocating
+     * the given amount of object references as payload.
      *
      * This function will not initialize any of the data stored in the object.
+     * It is defined in njvm.h, inlining the allocation fast path.
      */
-    [[nodiscard]] ObjRef allocateCompoundObject(size_t member_count);
+    [[nodiscard]] inline ObjRef allocateCompoundObject(VM &vm, size_t member_count);
 
 
     /**
@@ -224,15 +289,16 @@ namespace NJVM {
      * initialize them all to be a nil reference.
      *
      * @tparam numerical The type to describe the amount of members.
+     * @param vm The machine allocating the object.
      * @param size The amount of members allocated for the object.
      */
     template<typename numerical>
-    [[nodiscard]] ObjRef newNinjaObject(const numerical size) {
+    [[nodiscard]] ObjRef newNinjaObject(VM &vm, const numerical size) {
         if (size < 0) {
             throw std::logic_error("Cannot create object of negative size.");
         }
 
-        ObjRef created = allocateCompoundObject(size);
+        ObjRef created = allocateCompoundObject(vm, size);
         for (numerical index = 0; index < size; index++) {
             get_member(created, index) = nil; // Initialize all members with nil.
         }
@@ -240,7 +306,8 @@ namespace NJVM {
     }
 
     /**
-     * Create a new Ninja integer object with the given numerical value.
+     * Create a new Ninja integer object with the given numerical value. The
+     * object is allocated on the heap of the current machine.
      *
      * @tparam numeric The type to describe the integer value. It is casted to int.
      * @param i The integer value of the created Ninja object.
@@ -0,0 +1,71 @@
+/**
+ * Unit tests of the object header. Sizes and forwarding offsets beyond
+ * 32 bits are checked on a header alone, as allocating objects this large
+ * needs several gigabytes of memory.
+ *
+ * Every failed check is reported, the exit code is the amount of failures.
+ */
+
+#include <iostream>
+#include <cstdint>
+
+#include "types.h"
+
+namespace {
+    using namespace NJVM;
+
+    int failures = 0;
+
+    /**
+     * Report a failed check together with the values compared.
+     */
+    void expect_equal(const char *check, uint64_t actual, uint64_t expected) {
+        if (actual != expected) {
+            std::cerr << "FAILED " << check << ": " << actual << " instead of " << expected << std::endl;
+            failures++;
+        }
+    }
+
+    ninja_object make_header(uint64_t size, uint8_t flags) {
+        ninja_object header{};
+        header.size = size;
+        header.flags = flags;
+        return header;
+    }
+
+    void test_sizes_beyond_32_bits() {
+        for (uint64_t size: {UINT64_C(1) << 32, (UINT64_C(1) << 32) + 5, (UINT64_C(1) << 39) + 3,
+                             static_cast<uint64_t>(MAXIMUM_HEADER_SIZE)}) {
+            const ninja_object compound = make_header(size, COMPOUND_FLAG);
+            expect_equal("compound size", compound.get_size(), size);
+            expect_equal("compound flag", compound.is_compound(), true);
+            expect_equal("copied flag", compound.is_copied(), false);
+
+            const ninja_object integer = make_header(size, 0);
+            expect_equal("integer size", integer.get_size(), size);
+            expect_equal("integer flag", integer.is_compound(), false);
+        }
+    }
+
+    void test_forwarding_beyond_32_bits() {
+        for (uint64_t offset: {UINT64_C(1) << 32, (UINT64_C(5) << 32) + 8 * 3,
+                               MAXIMUM_HEAP_HALF_SIZE & ~(OBJECT_ALIGNMENT - 1)}) {
+            ninja_object header = make_header(17, COMPOUND_FLAG);
+            header.mark_copied(offset);
+            expect_equal("forwarding offset", header.get_size(), offset);
+            expect_equal("copied after forwarding", header.is_copied(), true);
+            expect_equal("compound after forwarding", header.is_compound(), true);
+            expect_equal("age after forwarding", header.age, 0);
+            expect_equal("hash after forwarding", header.hash, 0);
+        }
+    }
+}
+
+int main() {
+    test_sizes_beyond_32_bits();
+    test_forwarding_beyond_32_bits();
+    if (failures == 0) {
+        std::cout << "All object header checks passed." << std::endl;
+    }
+    return failures;
+}